@@ -1,7 +1,12 @@
 /*
- * Task for use with thread pool for directory traversing and filling of files map
+ * Staged hashing of files of equal size
  * No references this time
  *
+ * Content key of a file is extended stage by stage: probe of both ends,
+ * short prefix, long prefix and whole file. Files are taken to the next
+ * stage only while their key is shared by another file of the same size,
+ * so most of files are never read past the probe.
+ *
  * Author: Rytis Karpuška
  *         rytis.karpuska@gmail.com
  */
@@ -10,6 +15,8 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 
 #include "thread_pool.h"
@@ -18,125 +25,457 @@
 #include "list_utils.h"
 #include "file_desc.h"
 #include "murmur3_hash.h"
+#include "obj_cache.h"
+#include "size_index.h"
+#include "extent_hash.h"
+#include "hash_cache.h"
 
 #include "calc_hash_task.h"
 
 #define CHT_HASH_CHUNK			1048576 //1MB
 
-
-struct cht_enq_files_arg {
-	struct map *m;
+struct cht_stage_ctx {
 	struct thread_pool *tp;
+	int stage;
+};
+
+static const char *cht_stage_names[CHT_STAGES] = {
+	[CHT_STAGE_NONE] = "none",
+	[CHT_STAGE_PROBE] = "probe",
+	[CHT_STAGE_PREFIX] = "prefix",
+	[CHT_STAGE_PREFIX_LONG] = "prefix-long",
+	[CHT_STAGE_FULL] = "full",
+};
+
+//Bytes of prefix covered by each stage
+static const uint64_t cht_stage_end[CHT_STAGES] = {
+	[CHT_STAGE_NONE] = 0,
+	[CHT_STAGE_PROBE] = CHT_PROBE_SIZE,
+	[CHT_STAGE_PREFIX] = CHT_PREFIX_SIZE,
+	[CHT_STAGE_PREFIX_LONG] = CHT_PREFIX_LONG_SIZE,
+	[CHT_STAGE_FULL] = UINT64_MAX,
 };
 
+static struct cht_stats cht_stats;
+
 
-//Worker for calculating hash values for files
+//Bytes of a file read by the time it has reached a partial stage.
+//Tail probe is never read again, so it is counted for every stage
+static uint64_t cht_covered(int stage)
+{
+	if(stage == CHT_STAGE_NONE)
+		return 0;
+
+	return cht_stage_end[stage] + CHT_PROBE_SIZE;
+}
+
+
+//Read range of a file and add it into a key
+static int cht_hash_range(int f, uint64_t off, uint64_t end, uint8_t *buff,
+							uint64_t key[2])
+{
+	uint64_t curr_size;
+	ssize_t ret;
+
+	while(off < end){
+		//Calculate current chunk size
+		curr_size = end - off;
+		if(curr_size > CHT_HASH_CHUNK)
+			curr_size = CHT_HASH_CHUNK;
+
+		ret = pread(f, buff, curr_size, off);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0)
+			return -errno;
+
+		//File was truncated since it was listed
+		if(ret != curr_size)
+			return -EIO;
+
+		//Calculate hash of current chunk
+		murmur3(buff, curr_size, key);
+
+		off += curr_size;
+	}
+
+	return 0;
+}
+
+
+//Worker for advancing key of a file by a single stage
 void cht_hash_calc_worker(void *_arg)
 {
-	FILE *f;
 	struct file_desc *fd = _arg;
-	int hashed_size = 0;
-	int curr_size;
-	uint8_t *buff = malloc(CHT_HASH_CHUNK);
+	struct hc_entry *e;
+	int f, status, step = fd->hash_stage + 1, stage = step;
+	uint64_t key[2], start, end, read;
+	uint8_t *buff;
+
+	//Figure out part to be read, file small enough is read in whole
+	if(step == CHT_STAGE_PROBE && fd->size > 2 * CHT_PROBE_SIZE){
+		start = 0;
+		end = CHT_PROBE_SIZE;
+		read = 2 * CHT_PROBE_SIZE;
+	} else {
+		start = cht_stage_end[step - 1];
+		end = cht_stage_end[step];
+		if(step == CHT_STAGE_PROBE || end >= fd->size){
+			end = fd->size;
+			stage = CHT_STAGE_FULL;
+		}
+		read = end - start;
+	}
+
+	//Key of unchanged file may be known from previous runs
+	e = hc_get(fd);
+	if(e != NULL && (e->rec.stages & (1 << stage))){
+		__atomic_add_fetch(&cht_stats.cached[step], 1, __ATOMIC_RELAXED);
+		fd->hash[0] = e->rec.keys[stage][0];
+		fd->hash[1] = e->rec.keys[stage][1];
+		fd->hash_stage = stage;
+		return;
+	}
+
+	buff = oc_scratch(OC_SCRATCH_HASH, CHT_HASH_CHUNK);
 	if(buff == NULL){
 		fprintf(stderr, "Error: %s\n", strerror(ENOMEM));
 		return;
 	}
 
 	//open file
-	f = fopen(fd->filename, "r");
-	if(f == NULL){
+	f = open(fd->filename, O_RDONLY | O_CLOEXEC);
+	if(f < 0){
 		fprintf(stderr, "Error: %s: %s\n", fd->filename, strerror(errno));
-		free(buff);
 		return;
 	}
 
-	//Read in chunks and calculate hash
-	memset(fd->hash, 0, sizeof(fd->hash));
-	while(hashed_size < fd->size){
-		//Calculate current chunk size
-		curr_size = fd->size - hashed_size;
-		if(curr_size > CHT_HASH_CHUNK)
-			curr_size = CHT_HASH_CHUNK;
+	//Key of a stage extends key of the previous one
+	key[0] = fd->hash[0];
+	key[1] = fd->hash[1];
 
-		if(fread(buff, curr_size, 1, f) != 1){
-			fprintf(stderr, "Error reading file: %s\n", fd->filename);
-			goto CLEANUP;
-		}
+	status = cht_hash_range(f, start, end, buff, key);
 
-		//Calculate hash of current chunk
-		murmur3(buff, curr_size, fd->hash);
+	//Tail of probe
+	if(status == 0 && read != end - start)
+		status = cht_hash_range(f, fd->size - CHT_PROBE_SIZE, fd->size,
+								buff, key);
 
-		//increment hashed size
-		hashed_size += curr_size;
+	if(status != 0){
+		fprintf(stderr, "Error: %s: %s\n", fd->filename, strerror(-status));
+		goto CLEANUP;
 	}
 
-	//Validate hash
-	fd->hash_valid = 1;
+	__atomic_add_fetch(&cht_stats.files[step], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&cht_stats.bytes_read[step], read, __ATOMIC_RELAXED);
+
+	//Publish new key
+	fd->hash[0] = key[0];
+	fd->hash[1] = key[1];
+	fd->hash_stage = stage;
+
+	if(e != NULL){
+		e->rec.keys[stage][0] = key[0];
+		e->rec.keys[stage][1] = key[1];
+		e->rec.stages |= 1 << stage;
+		e->dirty = 1;
+	}
 
 CLEANUP:
-	fclose(f);
-	free(buff);
+	close(f);
 	return;
 }
 
 
-//Worker for deciding which files must have their hashes calculated
-void cht_enq_files_worker(void *_arg)
+int cht_hash_full(struct file_desc *fd)
 {
-	struct cht_enq_files_arg *arg = _arg;
+	int stage;
 
-	//check if we have anything in the list
-	if(arg->m->ST == NULL)
-		return;
-	if(arg->m->ST[0] == NULL)
-		return;
+	while(fd->hash_stage != CHT_STAGE_FULL){
+		stage = fd->hash_stage;
+		cht_hash_calc_worker(fd);
+
+		//Worker has reported the error and left the key as it was
+		if(fd->hash_stage == stage)
+			return -EIO;
+	}
 
-	//Iterate through list
-	struct node *mi;
-	struct mpmcq *matchlist; //Potential matches list
+	return 0;
+}
+
+
+//Try to take ownership of file hash calculation
+static int cht_claim(struct file_desc *fd)
+{
+	return __atomic_exchange_n(&fd->hash_queued, 1, __ATOMIC_SEQ_CST) == 0;
+}
+
+
+int cht_file_added(struct thread_pool *tp, struct mpmcq *matchlist,
+					struct file_desc *fd)
+{
 	struct mpmcq_elem *ni;
-	L_FOREACH(mi, arg->m->ST[0][0].ptr.ptr){
-		//Get potential matches list
-		matchlist = L_DATA(mi);
-		if(matchlist == NULL)
+	int status = 0;
+
+	//No need for hashing zero-sized files
+	if(fd->size == 0)
+		return 0;
+
+	//Check if we have enough elements for hashes to be useful
+	if(matchlist->elem_cnt < CHT_HASH_CALC_THD)
+		return 0;
+
+	//If first file of the list is still unclaimed, nobody has seen the list
+	//above threshold yet - claim all files present in the list.
+	//Files which saw list below threshold are guaranteed to be linked by now
+	ni = L_NEXT(matchlist->head.ptr.ptr);
+	if(!((struct file_desc *)L_DATA(ni))->hash_queued){
+		L_FOREACH(ni, L_NEXT(matchlist->head.ptr.ptr)){
+			if(L_DATA(ni) == NULL || !cht_claim(L_DATA(ni)))
+				continue;
+
+			//Enqueue task for hash calculation
+			if(tp_enqueueTask(tp, cht_hash_calc_worker, L_DATA(ni)) != 0)
+				status = -ENOMEM;
+		}
+		return status;
+	}
+
+	//Otherwise list is already being hashed, so only take care of ourselves
+	if(cht_claim(fd))
+		status = tp_enqueueTask(tp, cht_hash_calc_worker, fd);
+
+	return status;
+}
+
+
+//Order files by stage and key
+static int cht_key_cmp(const void *_a, const void *_b)
+{
+	const struct file_desc *a = *(struct file_desc * const *)_a;
+	const struct file_desc *b = *(struct file_desc * const *)_b;
+
+	if(a->hash_stage != b->hash_stage)
+		return a->hash_stage < b->hash_stage ? -1 : 1;
+	if(a->hash[0] != b->hash[0])
+		return a->hash[0] < b->hash[0] ? -1 : 1;
+	if(a->hash[1] != b->hash[1])
+		return a->hash[1] < b->hash[1] ? -1 : 1;
+
+	return 0;
+}
+
+
+//Order files by extent fingerprint, files without one go last
+static int cht_ext_cmp(const void *_a, const void *_b)
+{
+	const struct file_desc *a = *(struct file_desc * const *)_a;
+	const struct file_desc *b = *(struct file_desc * const *)_b;
+
+	if(a->ext_valid != b->ext_valid)
+		return a->ext_valid ? -1 : 1;
+	if(a->ext_hash[0] != b->ext_hash[0])
+		return a->ext_hash[0] < b->ext_hash[0] ? -1 : 1;
+	if(a->ext_hash[1] != b->ext_hash[1])
+		return a->ext_hash[1] < b->ext_hash[1] ? -1 : 1;
+
+	return 0;
+}
+
+
+void cht_sort_group(struct size_index *idx, struct si_group *g)
+{
+	struct file_desc *fd;
+	uint32_t i;
+
+	//Files sharing extents are never read, they follow their leader
+	for(i = 0; i < g->cnt; i++){
+		fd = SI_GROUP_FILE(idx, g, i);
+		if(fd->ext_leader == NULL)
 			continue;
 
-		//No need for hashing zero-sized files
-		if(L_KEY(mi) == 0)
+		fd->hash[0] = fd->ext_leader->hash[0];
+		fd->hash[1] = fd->ext_leader->hash[1];
+		fd->hash_stage = fd->ext_leader->hash_stage;
+	}
+
+	qsort(&SI_GROUP_FILE(idx, g, 0), g->cnt, sizeof(struct file_desc *),
+			cht_key_cmp);
+
+	return;
+}
+
+
+uint32_t cht_run_end(struct size_index *idx, struct si_group *g, uint32_t first)
+{
+	uint32_t last;
+
+	for(last = first + 1; last < g->cnt; last++)
+		if(cht_key_cmp(&SI_GROUP_FILE(idx, g, first),
+						&SI_GROUP_FILE(idx, g, last)) != 0)
+			break;
+
+	return last;
+}
+
+
+//Find files of a group sharing all extents and elect a leader for each set
+static void cht_extent_group(struct size_index *idx, struct si_group *g, void *ctx)
+{
+	struct file_desc *fd, *leader = NULL;
+	uint32_t i;
+
+	if(g->size == 0 || g->cnt < CHT_HASH_CALC_THD)
+		return;
+
+	//Query extent maps once for every file of the group
+	for(i = 0; i < g->cnt; i++){
+		fd = SI_GROUP_FILE(idx, g, i);
+		fd->ext_valid = eh_calc(fd, fd->ext_hash) == 0;
+	}
+
+	qsort(&SI_GROUP_FILE(idx, g, 0), g->cnt, sizeof(struct file_desc *),
+			cht_ext_cmp);
+
+	for(i = 0; i < g->cnt; i++){
+		fd = SI_GROUP_FILE(idx, g, i);
+		if(!fd->ext_valid)
+			break;
+
+		if(leader != NULL && cht_ext_cmp(&leader, &fd) == 0)
+			fd->ext_leader = leader;
+		else
+			leader = fd;
+	}
+
+	return;
+}
+
+
+//Count files of a run, which have to be read to tell them apart
+static uint32_t cht_run_leaders(struct size_index *idx, struct si_group *g,
+								uint32_t first, uint32_t last)
+{
+	uint32_t i, cnt = 0;
+
+	for(i = first; i < last; i++)
+		if(SI_GROUP_FILE(idx, g, i)->ext_leader == NULL)
+			cnt++;
+
+	return cnt;
+}
+
+
+static void cht_enqueue(struct thread_pool *tp, struct file_desc *fd)
+{
+	if(tp_enqueueTask(tp, cht_hash_calc_worker, fd) != 0)
+		fprintf(stderr, "Error: %s: %s\n", fd->filename, strerror(ENOMEM));
+
+	return;
+}
+
+
+//Enqueue files of a group which still share a key for the next stage
+static void cht_stage_group(struct size_index *idx, struct si_group *g, void *_ctx)
+{
+	struct cht_stage_ctx *ctx = _ctx;
+	struct file_desc *fd;
+	uint32_t first, last, i;
+	int prev = ctx->stage - 1;
+
+	if(g->size == 0 || g->cnt < CHT_HASH_CALC_THD)
+		return;
+
+	//Probes may have been streamed during traversal already
+	if(ctx->stage == CHT_STAGE_PROBE){
+		if(cht_run_leaders(idx, g, 0, g->cnt) < 2)
+			return;
+
+		for(i = 0; i < g->cnt; i++){
+			fd = SI_GROUP_FILE(idx, g, i);
+			if(fd->ext_leader == NULL && fd->hash_stage == CHT_STAGE_NONE &&
+					cht_claim(fd))
+				cht_enqueue(ctx->tp, fd);
+		}
+		return;
+	}
+
+	cht_sort_group(idx, g);
+	for(first = 0; first < g->cnt; first = last){
+		last = cht_run_end(idx, g, first);
+
+		fd = SI_GROUP_FILE(idx, g, first);
+		if(fd->hash_stage != prev)
 			continue;
 
-		//Check if we have enough elements for hashes to be useful
-		if(matchlist->elem_cnt < CHT_HASH_CALC_THD)
+		//File with a key of its own can't have a duplicate
+		if(last - first == 1){
+			__atomic_add_fetch(&cht_stats.dropped[prev], 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&cht_stats.bytes_saved[prev],
+								g->size - cht_covered(prev),
+								__ATOMIC_RELAXED);
 			continue;
+		}
 
-		//enqueue tasks for hash calculation
-		L_FOREACH(ni, matchlist->head.ptr.ptr){
-			if(L_DATA(ni) == NULL)
-				continue;
+		//Run consisting of a single extent set is equal already
+		if(cht_run_leaders(idx, g, first, last) < 2)
+			continue;
 
-			//Enqueue task for hash calculation
-			tp_enqueueTask(arg->tp, cht_hash_calc_worker, L_DATA(ni));
+		for(i = first; i < last; i++){
+			fd = SI_GROUP_FILE(idx, g, i);
+			if(fd->ext_leader == NULL)
+				cht_enqueue(ctx->tp, fd);
 		}
 	}
 
-	free(arg);
 	return;
 }
 
 
-int cht_start(struct thread_pool *tp, struct map *m)
+int cht_index_hash(struct thread_pool *tp, struct size_index *idx, int flags)
 {
-	struct cht_enq_files_arg *arg = malloc(sizeof(*arg));
-	if(arg == NULL)
-		return -ENOMEM;
+	struct cht_stage_ctx ctx;
+	int status;
+
+	if(flags & CHT_EXTENTS){
+		status = si_foreach(tp, idx, cht_extent_group, NULL);
+		tp_wait_idle(tp);
+		if(status != 0)
+			return status;
+	}
+
+	//Every stage only starts after keys of the previous one are known
+	ctx.tp = tp;
+	for(ctx.stage = CHT_STAGE_PROBE; ctx.stage <= CHT_STAGE_FULL; ctx.stage++){
+		status = si_foreach(tp, idx, cht_stage_group, &ctx);
+		tp_wait_idle(tp);
+		if(status != 0)
+			return status;
+	}
+
+	return 0;
+}
 
-	//fill in argument struct
-	arg->m = m;
-	arg->tp = tp;
 
-	//Enqueue task for thread pool
-	return tp_enqueueTask(tp, cht_enq_files_worker, arg);
+const char *cht_stage_name(int stage)
+{
+	return cht_stage_names[stage];
 }
 
 
+void cht_get_stats(struct cht_stats *s)
+{
+	int i;
+
+	for(i = 0; i < CHT_STAGES; i++){
+		s->files[i] = __atomic_load_n(&cht_stats.files[i], __ATOMIC_RELAXED);
+		s->bytes_read[i] = __atomic_load_n(&cht_stats.bytes_read[i],
+											__ATOMIC_RELAXED);
+		s->dropped[i] = __atomic_load_n(&cht_stats.dropped[i], __ATOMIC_RELAXED);
+		s->bytes_saved[i] = __atomic_load_n(&cht_stats.bytes_saved[i],
+											__ATOMIC_RELAXED);
+		s->cached[i] = __atomic_load_n(&cht_stats.cached[i], __ATOMIC_RELAXED);
+	}
+
+	return;
+}
@@ -9,30 +9,146 @@
 #ifndef __CALC_HASH_TASK_H
 #define __CALC_HASH_TASK_H
 
-#include "lf_map.h"
 #include "thread_pool.h"
+#include "mpmc_lf_queue.h"
+#include "file_desc.h"
+#include "size_index.h"
 
 
-#define CHT_HASH_CALC_THD			3
+#define CHT_HASH_CALC_THD			2
+
+//Stages of content key, every stage extends key of the previous one
+#define CHT_STAGE_NONE				0
+#define CHT_STAGE_PROBE				1		//First and last CHT_PROBE_SIZE bytes
+#define CHT_STAGE_PREFIX			2		//First CHT_PREFIX_SIZE bytes
+#define CHT_STAGE_PREFIX_LONG		3		//First CHT_PREFIX_LONG_SIZE bytes
+#define CHT_STAGE_FULL				4		//Whole file
+#define CHT_STAGES					5
+
+#define CHT_PROBE_SIZE				4096
+#define CHT_PREFIX_SIZE				131072		//128KB
+#define CHT_PREFIX_LONG_SIZE		4194304		//4MB
+
+//Index hashing flags
+#define CHT_EXTENTS					(1 << 0)	//Don't read files sharing extents
+
+//Representative of files sharing extents with fd
+#define CHT_EXT_LEADER(fd)			((fd)->ext_leader != NULL ? (fd)->ext_leader : (fd))
+
+//Staged hashing counters, indexed by stage
+struct cht_stats {
+	unsigned long files[CHT_STAGES];		//Files hashed at stage
+	unsigned long bytes_read[CHT_STAGES];	//Bytes read at stage
+	unsigned long dropped[CHT_STAGES];		//Files left without a match after stage
+	unsigned long bytes_saved[CHT_STAGES];	//Unread bytes of dropped files
+	unsigned long cached[CHT_STAGES];		//Keys found in hash cache
+};
 
 
 /*
- * Calculate hashes of files of the same size
- * In order for hash calculation to proceed there must be at least 4 files
- * of the same size
+ * Notify hashing about a file just enqueued into a list of files of the same size
+ *
+ * Probing is streamed together with directory traversal: as soon as a list
+ * reaches CHT_HASH_CALC_THD files, CHT_STAGE_PROBE keys are calculated for
+ * all its members and every later member is probed as it arrives.
+ * Each file is probed at most once, regardless of concurrent additions.
  *
  * Arguments:
- *		tp - thread pool for task execution
- *		m  - map of files to do a hash calculation on
+ *		tp        - thread pool for task execution
+ *		matchlist - list of files of the same size fd was enqueued into
+ *		fd        - file that was added
  *
  * Return:
  *		0                   - on success
  *		negative error code - on failure
  */
-int cht_start(struct thread_pool *tp, struct map *m);
+int cht_file_added(struct thread_pool *tp, struct mpmcq *matchlist,
+					struct file_desc *fd);
 
 
+/*
+ * Calculate content keys of files in a frozen index
+ *
+ * Keys are calculated stage by stage. After every stage each size group is
+ * split by keys and only files still sharing a key with another file are
+ * escalated to the next stage, so that files differing early are never read
+ * further. Files at CHT_STAGE_FULL with equal keys are the only candidates
+ * left for comparison. Waits for the pool to become idle, so must not be
+ * called from a pool thread.
+ *
+ * Arguments:
+ *		tp    - thread pool for task execution
+ *		idx   - index of potential matches
+ *		flags - CHT_EXTENTS bit, or 0
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - on failure
+ */
+int cht_index_hash(struct thread_pool *tp, struct size_index *idx, int flags);
+
 
+/*
+ * Advance key of a single file up to CHT_STAGE_FULL, in calling thread
+ *
+ * Stages already reached are not read again.
+ *
+ * Arguments:
+ *		fd - file to be hashed
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - if file could not be read in whole
+ */
+int cht_hash_full(struct file_desc *fd);
+
+
+/*
+ * Order files of a group, so that files with equal keys are adjacent
+ *
+ * Keys of files sharing extents with another file are brought up to date
+ * with their leader first.
+ *
+ * Arguments:
+ *		idx - index of potential matches
+ *		g   - group to be sorted
+ */
+void cht_sort_group(struct size_index *idx, struct si_group *g);
+
+
+/*
+ * Find end of a run of files with equal keys in a sorted group
+ *
+ * Arguments:
+ *		idx   - index of potential matches
+ *		g     - group sorted with cht_sort_group
+ *		first - position of the first file of the run
+ *
+ * Return:
+ *		position past the last file of the run
+ */
+uint32_t cht_run_end(struct size_index *idx, struct si_group *g, uint32_t first);
+
+
+/*
+ * Get name of a hashing stage
+ *
+ * Arguments:
+ *		stage - one of CHT_STAGE_*
+ *
+ * Return:
+ *		static string
+ */
+const char *cht_stage_name(int stage);
+
+
+/*
+ * Get staged hashing counters
+ *
+ * Arguments:
+ *		s - structure to fill with counters
+ */
+void cht_get_stats(struct cht_stats *s);
 
 
 #endif
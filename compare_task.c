@@ -9,227 +9,694 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 #include "thread_pool.h"
-#include "lf_map.h"
-#include "mpmc_lf_queue.h"
-#include "list_utils.h"
+#include "size_index.h"
 #include "file_desc.h"
+#include "obj_cache.h"
+#include "calc_hash_task.h"
+#include "output.h"
+#include "snapshot.h"
+#include "dedupe.h"
 
 #include "compare_task.h"
 
 
 #define CT_CMP_CHUNK		1048576 //1MB
+#define CT_OPEN_FILES		64		//Files of a class kept open by a single task
+
+//File of a run of equal keys
+struct ct_member {
+	struct file_desc *fd;
+	int f;			//Open descriptor, or -1 if reopened for every chunk
+	int failed;
+	int deduped;	//Found equal to the first member by filesystem, not read
+	uint32_t cls;	//Member, equivalence class of which this one belongs to
+};
 
+//Part of members known to be equal up to an offset
+struct ct_class {
+	uint32_t first;
+	uint32_t last;
+	uint64_t off;
+};
 
-struct comparison_arg {
-	struct map *m;
-	struct thread_pool *tp;
-
-	struct mpmcq *matchlist;
+struct class_arg {
+	struct tp_task task;
 
-	struct file_desc *f1;
-	struct file_desc *f2;
+	uint64_t size;
+	uint32_t cnt;
+	struct ct_member m[];
 };
 
+static struct ct_stats ct_stats;
+static int ct_flags;
 
-static int print_match(char *f1, char *f2)
+
+//Print all pairs of two equal files, including their hard links
+static void print_matches(struct file_desc *f1, struct file_desc *f2)
 {
-	fprintf(stdout, "%s %s\n", f1, f2);
+	struct file_desc *a1, *a2;
 
-	return 0;
+	out_pair(f1->filename, f2->filename);
+	for(a2 = f2->aliases; a2 != NULL; a2 = a2->next)
+		out_pair(f1->filename, a2->filename);
+
+	for(a1 = f1->aliases; a1 != NULL; a1 = a1->next){
+		out_pair(a1->filename, f2->filename);
+		for(a2 = f2->aliases; a2 != NULL; a2 = a2->next)
+			out_pair(a1->filename, a2->filename);
+	}
+
+	return;
 }
 
 
-void ct_file_worker(void *_arg)
+//Hard links of the same inode are equal without reading anything
+static void print_aliases(struct file_desc *f)
 {
-	struct comparison_arg *arg = _arg;
-	uint8_t *buff1 = NULL, *buff2 = NULL;
-	FILE *f1 = NULL, *f2 = NULL;
-	int compared_size = 0, chunk_size;
+	struct file_desc *a1, *a2;
 
-	//Open first file
-	f1 = fopen(arg->f1->filename, "r");
-	if(f1 == NULL){
-		fprintf(stderr, "Error: %s %s\n", arg->f1->filename, strerror(errno));
-		goto CLEANUP;
+	for(a1 = f->aliases; a1 != NULL; a1 = a1->next){
+		out_pair(f->filename, a1->filename);
+		for(a2 = a1->next; a2 != NULL; a2 = a2->next)
+			out_pair(a1->filename, a2->filename);
 	}
 
-	//open second file
-	f2 = fopen(arg->f2->filename, "r");
-	if(f2 == NULL){
-		fprintf(stderr, "Error: %s %s\n", arg->f1->filename, strerror(errno));
-		goto CLEANUP;
+	return;
+}
+
+
+//Files sharing extents follow their leader, leaders read for all of them
+static int ct_member_cmp(const void *_a, const void *_b)
+{
+	const struct ct_member *a = _a, *b = _b;
+	const struct file_desc *la = CHT_EXT_LEADER(a->fd), *lb = CHT_EXT_LEADER(b->fd);
+
+	if(la != lb)
+		return la < lb ? -1 : 1;
+	if((a->fd->ext_leader == NULL) != (b->fd->ext_leader == NULL))
+		return a->fd->ext_leader == NULL ? -1 : 1;
+
+	return 0;
+}
+
+
+//Read a chunk of a member, opening it if it is not kept open
+static int ct_read(struct ct_member *mb, uint64_t off, uint64_t len, uint8_t *buff)
+{
+	ssize_t ret;
+	int f = mb->f;
+
+	if(f < 0){
+		f = open(mb->fd->filename, O_RDONLY | O_CLOEXEC);
+		if(f < 0){
+			fprintf(stderr, "Error: %s %s\n", mb->fd->filename, strerror(errno));
+			return -errno;
+		}
 	}
 
-	//allocate buffers
-	buff1 = malloc(CT_CMP_CHUNK);
-	if(buff1 == NULL){
-		fprintf(stderr, "Error: Out of memory\n");
-		goto CLEANUP;
+	do {
+		ret = pread(f, buff, len, off);
+	} while(ret < 0 && errno == EINTR);
+
+	if(mb->f < 0)
+		close(f);
+
+	if(ret != len){
+		fprintf(stderr, "Error reading file %s\n", mb->fd->filename);
+		return -EIO;
 	}
-	buff2 = malloc(CT_CMP_CHUNK);
-	if(buff2 == NULL){
-		fprintf(stderr, "Error: Out of memory\n");
-		goto CLEANUP;
+	__atomic_add_fetch(&ct_stats.bytes_read, len, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+
+//Check size of a member against size it is compared at
+static int ct_size_changed(struct ct_member *mb, uint64_t size)
+{
+	struct stat st;
+	int ret;
+
+	if(mb->f >= 0)
+		ret = fstat(mb->f, &st);
+	else
+		ret = stat(mb->fd->filename, &st);
+
+	if(ret != 0 || st.st_size != size){
+		fprintf(stderr, "Error: %s changed since it was listed\n", mb->fd->filename);
+		return 1;
 	}
 
-	//Read in chunks and compare
-	while(compared_size < arg->f1->size){
+	return 0;
+}
+
+
+//Read members of a class in lock-step and split it wherever chunks differ
+static void ct_class_split(struct class_arg *arg, uint32_t *order,
+							struct ct_class *stack, uint32_t *stack_cnt,
+							uint8_t *buff1, uint8_t *buff2)
+{
+	struct ct_class c = stack[--(*stack_cnt)];
+	struct ct_member *rep, *mb;
+	uint64_t chunk_size;
+	uint32_t k, split, tmp;
+
+	while(c.last - c.first > 1 && c.off < arg->size){
 		//Determine chunk size to be read
-		chunk_size = arg->f1->size - compared_size;
+		chunk_size = arg->size - c.off;
 		if(chunk_size > CT_CMP_CHUNK)
 			chunk_size = CT_CMP_CHUNK;
 
-		//read chunks from files
-		if(fread(buff1, chunk_size, 1, f1) != 1){
-			fprintf(stderr, "Error reading file %s\n", arg->f1->filename);
-			goto CLEANUP;
+		//Unreadable file can't be a duplicate of anything
+		rep = &arg->m[order[c.first]];
+		if(rep->failed || ct_read(rep, c.off, chunk_size, buff1) != 0){
+			rep->failed = 1;
+			c.first++;
+			continue;
 		}
-		if(fread(buff2, chunk_size, 1, f2) != 1){
-			fprintf(stderr, "Error reading file %s\n", arg->f1->filename);
-			goto CLEANUP;
+
+		//Move members with different chunks to the end of a class
+		split = c.last;
+		for(k = c.first + 1; k < split; ){
+			mb = &arg->m[order[k]];
+			if(!mb->failed && ct_read(mb, c.off, chunk_size, buff2) != 0)
+				mb->failed = 1;
+			if(!mb->failed && memcmp(buff1, buff2, chunk_size) == 0){
+				k++;
+				continue;
+			}
+
+			tmp = order[k];
+			order[k] = order[--split];
+			order[split] = tmp;
 		}
 
-		//compare buffers
-		if(memcmp(buff1, buff2, chunk_size) != 0)
-			goto CLEANUP;
+		//Differing members still may be equal among themselves
+		if(split != c.last){
+			stack[*stack_cnt].first = split;
+			stack[*stack_cnt].last = c.last;
+			stack[*stack_cnt].off = c.off;
+			(*stack_cnt)++;
+			c.last = split;
+			__atomic_add_fetch(&ct_stats.splits, 1, __ATOMIC_RELAXED);
+		}
 
-		//increment size counter
-		compared_size += chunk_size;
+		c.off += chunk_size;
 	}
 
-	print_match(arg->f1->filename, arg->f2->filename);
+	//Members left are equal
+	if(c.last - c.first > 1)
+		__atomic_add_fetch(&ct_stats.classes, 1, __ATOMIC_RELAXED);
+	for(k = c.first; k < c.last; k++)
+		if(!arg->m[order[k]].failed)
+			arg->m[order[k]].cls = order[c.first];
 
-CLEANUP:
-	free(buff1);
-	free(buff2);
-	if(f1 != NULL)
-		fclose(f1);
-	if(f2 != NULL)
-		fclose(f2);
-	free(arg);
 	return;
 }
 
 
-void ct_hash_worker(void *_arg)
+//Let filesystem compare leaders with the first one while sharing their
+//extents. Leaders found equal are dropped from order, so they are not read
+static uint32_t ct_dedupe_first(struct class_arg *arg, uint32_t *order, uint32_t cnt)
 {
-	struct comparison_arg *n_arg, *arg = _arg;
+	struct ct_member *rep = &arg->m[order[0]], *mb;
+	int dst[CT_OPEN_FILES], status[CT_OPEN_FILES];
+	uint32_t first, n, i, left = 1;
+	int ret;
+
+	if(rep->failed || rep->f < 0)
+		return cnt;
+
+	for(first = 1; first < cnt; first += n){
+		n = cnt - first;
+		if(n > CT_OPEN_FILES)
+			n = CT_OPEN_FILES;
+
+		for(i = 0; i < n; i++){
+			mb = &arg->m[order[first + i]];
+			dst[i] = mb->failed ? -1 : mb->f;
+			if(!mb->failed && dst[i] < 0)
+				dst[i] = open(mb->fd->filename, O_RDONLY | O_CLOEXEC);
+		}
 
-	struct mpmcq_elem *base, *trg;
-	struct file_desc *base_fd, *trg_fd;
-	L_FOREACH(base, arg->matchlist->head.ptr.ptr){
-		if(L_DATA(base) == NULL)
-			continue;
+		ret = dd_extents(rep->f, arg->size, dst, status, n);
 
-		L_FOREACH(trg, base){
-			//skip empty entries
-			if(trg == NULL)
-				continue;
+		for(i = 0; i < n; i++){
+			mb = &arg->m[order[first + i]];
+			if(mb->f < 0 && dst[i] >= 0)
+				close(dst[i]);
 
-			//skip the same files
-			if(trg == base)
-				continue;
+			if(!mb->failed && status[i] == DD_SAME){
+				mb->deduped = 1;
+				mb->cls = order[0];
+				__atomic_add_fetch(&ct_stats.deduped, 1, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&ct_stats.bytes_reclaimed, arg->size, __ATOMIC_RELAXED);
+			} else {
+				order[left++] = order[first + i];
+			}
+		}
 
-			//get file descriptors
-			base_fd = L_DATA(base);
-			trg_fd = L_DATA(trg);
+		//Filesystem can't share extents, the rest is read
+		if(ret != 0){
+			for(i = first + n; i < cnt; i++)
+				order[left++] = order[i];
+			break;
+		}
+	}
 
-			//if both sizes are equal to zero - we treat files as the same in content
-			if(base_fd->size == 0 && trg_fd->size == 0){
-				print_match(base_fd->filename, trg_fd->filename);
-				continue;
-			}
+	return left;
+}
+
+
+//Check stat data of a name against the file it was listed as. Content may
+//be rewritten in place without changing size, but not without mtime
+static int ct_unchanged(struct stat *st, struct file_desc *fd, uint64_t size)
+{
+	return st->st_ino == fd->ino && st->st_size == size &&
+			st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec == fd->mtime;
+}
+
+
+//Replace a name of a file with a hard link to an equal file
+//Return 1 if replaced, 0 if it is a link of that file already, negative
+//error code otherwise
+static int ct_link_name(struct file_desc *rep, struct file_desc *fd,
+						const char *name, uint64_t size, nlink_t *nlink)
+{
+	struct stat st;
+	int ret;
+
+	if(lstat(name, &st) != 0){
+		fprintf(stderr, "Error: %s %s\n", name, strerror(errno));
+		return -errno;
+	}
+
+	//Names of one inode may be left apart by traversal
+	if(st.st_dev == rep->dev && st.st_ino == rep->ino)
+		return 0;
+
+	//Ctime is not checked, it changes with every alias replaced
+	if(!ct_unchanged(&st, fd, size)){
+		fprintf(stderr, "Error: %s changed since it was compared\n", name);
+		return -EAGAIN;
+	}
+
+	if(*nlink == 0)
+		*nlink = st.st_nlink;
+
+	ret = dd_link(rep->filename, name);
+	if(ret != 0){
+		fprintf(stderr, "Error: %s %s\n", name, strerror(-ret));
+		return ret;
+	}
+
+	return 1;
+}
+
+
+//Replace every name of a file with a hard link to an equal file
+static void ct_link(struct file_desc *rep, struct file_desc *fd, uint64_t size)
+{
+	struct file_desc *a;
+	unsigned long names = 1, linked = 0;
+	nlink_t nlink = 0;
+	struct stat st;
+
+	//Hard links can't cross filesystems, links of one inode need nothing
+	if(fd->dev != rep->dev || fd->ino == rep->ino)
+		return;
+
+	//Names are linked to content of the first file, so it must be as compared
+	if(lstat(rep->filename, &st) != 0 || st.st_dev != rep->dev ||
+			!ct_unchanged(&st, rep, size)){
+		fprintf(stderr, "Error: %s changed since it was compared\n", rep->filename);
+		return;
+	}
+
+	if(ct_link_name(rep, fd, fd->filename, size, &nlink) > 0)
+		linked++;
+
+	for(a = fd->aliases; a != NULL; a = a->next, names++)
+		if(ct_link_name(rep, fd, a->filename, size, &nlink) > 0)
+			linked++;
+
+	//Storage is released only once the last name of an inode is gone
+	__atomic_add_fetch(&ct_stats.linked, linked, __ATOMIC_RELAXED);
+	if(linked == names && nlink == names)
+		__atomic_add_fetch(&ct_stats.bytes_reclaimed, size, __ATOMIC_RELAXED);
+
+	return;
+}
+
+
+//Deduplicate members of a class with the member it is named after, sharing
+//extents if filesystem can, hard linking them otherwise
+static void ct_dedupe_class(struct class_arg *arg, uint32_t c)
+{
+	struct ct_member *rep = &arg->m[c], *mb;
+	int dst[CT_OPEN_FILES], status[CT_OPEN_FILES];
+	uint32_t mbs[CT_OPEN_FILES];
+	uint32_t i, k, n;
+	int src, ret;
+
+	src = open(rep->fd->filename, O_RDONLY | O_CLOEXEC);
+	if(src < 0){
+		fprintf(stderr, "Error: %s %s\n", rep->fd->filename, strerror(errno));
+		return;
+	}
 
-			//Skip files with non-matching hashes
-			if(base_fd->hash_valid && trg_fd->hash_valid &&
-					memcmp(base_fd->hash, trg_fd->hash, sizeof(base_fd->hash)) != 0)
+	for(i = 0; i < arg->cnt; ){
+		//Collect a batch of members not sharing extents with the first one
+		for(n = 0; i < arg->cnt && n < CT_OPEN_FILES; i++){
+			mb = &arg->m[i];
+			if(i == c || mb->cls != c || mb->deduped ||
+					CHT_EXT_LEADER(mb->fd) == CHT_EXT_LEADER(rep->fd))
 				continue;
 
-			//allocate memory for a new task
-			n_arg = malloc(sizeof(*n_arg));
-			if(n_arg == NULL){
-				fprintf(stderr, "Out of memory\n");
+			dst[n] = open(mb->fd->filename, O_RDONLY | O_CLOEXEC);
+			if(dst[n] < 0){
+				fprintf(stderr, "Error: %s %s\n", mb->fd->filename, strerror(errno));
 				continue;
 			}
+			mbs[n++] = i;
+		}
 
-			//fill in fields
-			n_arg->m = arg->m;
-			n_arg->tp = arg->tp;
-			n_arg->matchlist = NULL;
-			n_arg->f1 = base_fd;
-			n_arg->f2 = trg_fd;
-
-			//Enqueue comparison task
-			tp_enqueueTask(arg->tp, ct_file_worker, n_arg);
+		ret = dd_extents(src, arg->size, dst, status, n);
+
+		for(k = 0; k < n; k++){
+			close(dst[k]);
+			mb = &arg->m[mbs[k]];
+
+			//Files sharing extents with another one are not counted
+			if(status[k] == DD_SAME){
+				__atomic_add_fetch(&ct_stats.deduped, 1, __ATOMIC_RELAXED);
+				if(mb->fd->ext_leader == NULL)
+					__atomic_add_fetch(&ct_stats.bytes_reclaimed, arg->size,
+										__ATOMIC_RELAXED);
+			} else if(status[k] == DD_DIFFERS){
+				fprintf(stderr, "Error: %s changed since it was compared\n",
+						mb->fd->filename);
+			} else if(status[k] == DD_FAILED){
+				//Older kernels tell EINVAL if filesystem can't share extents
+				if(ret == -EOPNOTSUPP || ret == -ENOTTY || ret == -EINVAL)
+					ct_link(rep->fd, mb->fd, arg->size);
+				else
+					fprintf(stderr, "Error: %s %s\n", mb->fd->filename, strerror(-ret));
+			} else if(status[k] != -EXDEV){
+				fprintf(stderr, "Error: %s %s\n", mb->fd->filename, strerror(-status[k]));
+			}
 		}
 	}
 
-	//Release my arguments
-	free(arg);
+	close(src);
+	return;
+}
+
+
+//Deduplicate every class of a run
+static void ct_dedupe(struct class_arg *arg)
+{
+	uint32_t i, j;
+
+	for(i = 0; i < arg->cnt; i++){
+		if(arg->m[i].cls != i)
+			continue;
+
+		//Class needs no work if the rest of it shares extents already
+		for(j = 0; j < arg->cnt; j++)
+			if(j != i && arg->m[j].cls == i && !arg->m[j].deduped &&
+					CHT_EXT_LEADER(arg->m[j].fd) != CHT_EXT_LEADER(arg->m[i].fd))
+				break;
+		if(j < arg->cnt)
+			ct_dedupe_class(arg, i);
+	}
 
 	return;
 }
 
 
-void ct_enq_worker(void *_arg)
+//Print a set of equal files together with their hard links, log it if needed
+static void ct_print_set(uint64_t size, struct ct_member *m, uint32_t cnt)
 {
-	struct comparison_arg *arg = _arg;
-	struct comparison_arg *n_arg;
+	struct file_desc *a;
+	const char **names;
+	uint32_t i, n = 0, leaders = 0;
+
+	for(i = 0; i < cnt; i++){
+		n++;
+		for(a = m[i].fd->aliases; a != NULL; a = a->next)
+			n++;
+	}
 
-	//check if we have anything in the list
-	if(arg->m->ST == NULL)
+	if(n < 2)
 		return;
-	if(arg->m->ST[0] == NULL)
+
+	names = malloc(sizeof(*names) * n);
+	if(names == NULL){
+		fprintf(stderr, "Error: Out of memory\n");
 		return;
+	}
 
-	//Iterate through list
-	struct node *mi;
-	struct mpmcq *matchlist; //Potential matches list
-	L_FOREACH(mi, arg->m->ST[0][0].ptr.ptr){
-		//Get potential matches list
-		matchlist = L_DATA(mi);
-		if(matchlist == NULL)
+	//Only files of separate storage waste space
+	for(i = 0, n = 0; i < cnt; i++){
+		if(m[i].fd->ext_leader == NULL)
+			leaders++;
+
+		names[n++] = m[i].fd->filename;
+		for(a = m[i].fd->aliases; a != NULL; a = a->next)
+			names[n++] = a->filename;
+	}
+
+	if(out_format() != OUT_PAIRS)
+		out_set(size, size * (leaders - 1), names, n);
+	if(ct_flags & CT_SNAPSHOT)
+		ss_log_set(size, names, n);
+	free(names);
+
+	return;
+}
+
+
+static int ct_cls_cmp(const void *_a, const void *_b)
+{
+	const struct ct_member *a = _a, *b = _b;
+
+	if(a->cls != b->cls)
+		return a->cls < b->cls ? -1 : 1;
+
+	return 0;
+}
+
+
+//Print every class of a run as a set
+static void ct_print_sets(struct class_arg *arg)
+{
+	uint32_t first, last;
+
+	qsort(arg->m, arg->cnt, sizeof(arg->m[0]), ct_cls_cmp);
+
+	for(first = 0; first < arg->cnt; first = last){
+		for(last = first + 1; last < arg->cnt; last++)
+			if(arg->m[last].cls != arg->m[first].cls)
+				break;
+
+		ct_print_set(arg->size, &arg->m[first], last - first);
+	}
+
+	return;
+}
+
+
+//Print all pairs of equal files of a run
+static void ct_print_pairs(struct class_arg *arg)
+{
+	uint32_t i, j;
+
+	for(i = 0; i < arg->cnt; i++){
+		print_aliases(arg->m[i].fd);
+
+		for(j = 0; j < i; j++)
+			if(arg->m[j].cls == arg->m[i].cls)
+				print_matches(arg->m[j].fd, arg->m[i].fd);
+	}
+
+	return;
+}
+
+
+//Compare all files of a run of equal keys, reading every file once
+void ct_class_worker(void *_arg)
+{
+	struct class_arg *arg = _arg;
+	struct ct_member *mb;
+	struct ct_class *stack = NULL;
+	uint32_t *order = NULL, i, lead, leaders = 0, stack_cnt = 0;
+	uint8_t *buff1, *buff2;
+
+	qsort(arg->m, arg->cnt, sizeof(arg->m[0]), ct_member_cmp);
+
+	//Every member starts in a class of its own, followers join their leader
+	for(i = 0; i < arg->cnt; i++){
+		mb = &arg->m[i];
+		mb->f = -1;
+		mb->failed = 0;
+		mb->deduped = 0;
+		mb->cls = i;
+	}
+
+	//if sizes are equal to zero - we treat files as the same in content
+	if(arg->size == 0){
+		for(i = 0; i < arg->cnt; i++)
+			arg->m[i].cls = 0;
+		goto PRINT;
+	}
+
+	//Keys of files which could not be fully hashed mean nothing
+	if(arg->m[0].fd->hash_stage != CHT_STAGE_FULL)
+		goto PRINT;
+
+	//get buffers
+	buff1 = oc_scratch(OC_SCRATCH_CMP1, CT_CMP_CHUNK);
+	buff2 = oc_scratch(OC_SCRATCH_CMP2, CT_CMP_CHUNK);
+	order = malloc(sizeof(*order) * arg->cnt);
+	stack = malloc(sizeof(*stack) * arg->cnt);
+	if(buff1 == NULL || buff2 == NULL || order == NULL || stack == NULL){
+		fprintf(stderr, "Error: Out of memory\n");
+		goto PRINT;
+	}
+
+	for(i = 0; i < arg->cnt; i++){
+		mb = &arg->m[i];
+		if(mb->fd->ext_leader != NULL)
 			continue;
 
-		//we need at least two files for matching
-		if(matchlist->elem_cnt < 2)
+		//Keep first files open, the rest is opened for every chunk
+		if(leaders < CT_OPEN_FILES)
+			mb->f = open(mb->fd->filename, O_RDONLY | O_CLOEXEC);
+		order[leaders++] = i;
+
+		//Size taken from a snapshot may be stale, if file changed in place
+		if((ct_flags & CT_SNAPSHOT) && ct_size_changed(mb, arg->size))
+			mb->failed = 1;
+	}
+
+	//Leaders found equal by filesystem are deduplicated already
+	if(ct_flags & CT_DEDUPE)
+		leaders = ct_dedupe_first(arg, order, leaders);
+
+	stack[0].first = 0;
+	stack[0].last = leaders;
+	stack[0].off = 0;
+	stack_cnt = 1;
+	while(stack_cnt > 0)
+		ct_class_split(arg, order, stack, &stack_cnt, buff1, buff2);
+
+	for(i = 0; i < arg->cnt; i++)
+		if(arg->m[i].f >= 0)
+			close(arg->m[i].f);
+
+PRINT:
+	//Followers are equal to the leader preceding them
+	for(i = 0, lead = 0; i < arg->cnt; i++){
+		if(arg->m[i].fd->ext_leader == NULL){
+			lead = i;
 			continue;
+		}
+
+		arg->m[i].cls = arg->m[lead].cls;
+		__atomic_add_fetch(&ct_stats.extent_matches, i - lead, __ATOMIC_RELAXED);
+	}
+
+	//Empty files have no storage to be shared
+	if((ct_flags & CT_DEDUPE) && arg->size > 0)
+		ct_dedupe(arg);
+
+	if(out_format() == OUT_PAIRS)
+		ct_print_pairs(arg);
+	if(out_format() != OUT_PAIRS || (ct_flags & CT_SNAPSHOT))
+		ct_print_sets(arg);
+
+	free(order);
+	free(stack);
+	oc_free(arg);
+	return;
+}
+
 
-		//Fill in the fields
-		n_arg = malloc(sizeof(*n_arg));
+//Enqueue comparison of every run of files with equal keys within a group of
+//files of the same size
+static void ct_hash_group(struct size_index *idx, struct si_group *g, void *ctx)
+{
+	struct thread_pool *tp = ctx;
+	struct class_arg *n_arg;
+	struct ct_member single;
+	uint32_t i, first, last;
+
+	//Zero sized files are never hashed and are the same in content
+	cht_sort_group(idx, g);
+	for(first = 0; first < g->cnt; first = last){
+		last = g->size == 0 ? g->cnt : cht_run_end(idx, g, first);
+
+		//File without a match may still have hard links
+		if(last - first < 2){
+			single.fd = SI_GROUP_FILE(idx, g, first);
+			if(out_format() == OUT_PAIRS)
+				print_aliases(single.fd);
+			if(out_format() != OUT_PAIRS || (ct_flags & CT_SNAPSHOT))
+				ct_print_set(g->size, &single, 1);
+			continue;
+		}
+
+		//allocate memory for a new task
+		n_arg = oc_alloc(sizeof(*n_arg) + sizeof(n_arg->m[0]) * (last - first));
 		if(n_arg == NULL){
 			fprintf(stderr, "Out of memory\n");
 			continue;
 		}
-		n_arg->m = arg->m;
-		n_arg->tp = arg->tp;
-		n_arg->matchlist = matchlist;
 
-		//enqueue for hash processing
-		tp_enqueueTask(arg->tp, ct_hash_worker, n_arg);
+		//fill in fields
+		n_arg->size = g->size;
+		n_arg->cnt = last - first;
+		for(i = first; i < last; i++)
+			n_arg->m[i - first].fd = SI_GROUP_FILE(idx, g, i);
+
+		//Enqueue comparison task
+		n_arg->task.task = ct_class_worker;
+		n_arg->task.arg = n_arg;
+		n_arg->task.pool_owned = 0;
+		if(tp_enqueue(tp, &n_arg->task) != 0)
+			oc_free(n_arg);
 	}
 
-	free(arg);
-
 	return;
 }
 
 
-int ct_start(struct thread_pool *tp, struct map *m)
+int ct_start(struct thread_pool *tp, struct size_index *idx, int flags)
 {
-	//Allocate arguments struct
-	struct comparison_arg *arg = malloc(sizeof(*arg));
-	if(arg == NULL)
-		return -ENOMEM;
+	ct_flags = flags;
 
-	//fill in fields
-	arg->m = m;
-	arg->tp = tp;
-
-	return tp_enqueueTask(tp, ct_enq_worker, arg);
+	//Process all size groups in parallel
+	return si_foreach(tp, idx, ct_hash_group, tp);
 }
 
 
+void ct_get_stats(struct ct_stats *s)
+{
+	s->extent_matches = __atomic_load_n(&ct_stats.extent_matches, __ATOMIC_RELAXED);
+	s->classes = __atomic_load_n(&ct_stats.classes, __ATOMIC_RELAXED);
+	s->splits = __atomic_load_n(&ct_stats.splits, __ATOMIC_RELAXED);
+	s->bytes_read = __atomic_load_n(&ct_stats.bytes_read, __ATOMIC_RELAXED);
+	s->deduped = __atomic_load_n(&ct_stats.deduped, __ATOMIC_RELAXED);
+	s->linked = __atomic_load_n(&ct_stats.linked, __ATOMIC_RELAXED);
+	s->bytes_reclaimed = __atomic_load_n(&ct_stats.bytes_reclaimed, __ATOMIC_RELAXED);
+
+	return;
+}
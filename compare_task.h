@@ -10,22 +10,55 @@
 #define __COMPARE_TASK_H
 
 #include "thread_pool.h"
-#include "lf_map.h"
+#include "size_index.h"
 
+//Comparison flags
+#define CT_SNAPSHOT			(1 << 0)	//Log sets of equal files into snapshot
+#define CT_DEDUPE			(1 << 1)	//Deduplicate sets of equal files
+
+//Comparison counters
+struct ct_stats {
+	unsigned long extent_matches;
+	unsigned long classes;			//Classes of at least two equal files read
+	unsigned long splits;			//Classes split on a differing chunk
+	unsigned long bytes_read;
+	unsigned long deduped;			//Files sharing extents with an equal file
+	unsigned long linked;			//Names replaced by hard links
+	unsigned long bytes_reclaimed;
+};
 
 /*
- * Compare hashes and files to figure out if they are the same in content
+ * Compare files with equal keys to figure out if they are the same in content
+ *
+ * Keys must have been calculated with cht_index_hash beforehand. All files
+ * of a run of equal keys are read in lock-step by a single task, which
+ * splits the run wherever chunks differ, so every file is read once.
+ *
+ * With CT_DEDUPE, filesystem is asked to share extents of the first file of
+ * a run with the rest before reading. Files it found equal are not read.
+ * Remaining classes are deduplicated once verified, by hard links on
+ * filesystems which can't share extents.
  *
  * Arguments:
- *		tp - thread pool for task execution
- *		m  - map of potential matches
+ *		tp    - thread pool for task execution
+ *		idx   - frozen index of potential matches
+ *		flags - CT_SNAPSHOT, CT_DEDUPE bits, or 0
  *
  * Return:
  *		0                   - on success
  *		negative error code - on failure
  *
  */
-int ct_start(struct thread_pool *tp, struct map *m);
+int ct_start(struct thread_pool *tp, struct size_index *idx, int flags);
+
+
+/*
+ * Get comparison counters
+ *
+ * Arguments:
+ *		s - structure to fill with counters
+ */
+void ct_get_stats(struct ct_stats *s);
 
 
 #endif
@@ -0,0 +1,116 @@
+/*
+ * Deduplication of equal files
+ * Reference: https://man7.org/linux/man-pages/man2/ioctl_fideduperange.2.html
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "dedupe.h"
+
+struct dd_range {
+	struct file_dedupe_range r;
+	struct file_dedupe_range_info info[DD_DESTS_PER_CALL];
+};
+
+static unsigned long dd_seq;
+
+
+int dd_extents(int src, uint64_t size, const int *dst, int *status, uint32_t cnt)
+{
+	struct dd_range r;
+	uint32_t idx[DD_DESTS_PER_CALL];
+	uint32_t first, n, i, k;
+	uint64_t off, len;
+	int err;
+
+	for(first = 0; first < cnt; first += n){
+		n = cnt - first;
+		if(n > DD_DESTS_PER_CALL)
+			n = DD_DESTS_PER_CALL;
+
+		for(i = first; i < first + n; i++)
+			status[i] = DD_SAME;
+
+		for(off = 0; off < size; off += len){
+			len = size - off;
+			if(len > DD_RANGE_SIZE)
+				len = DD_RANGE_SIZE;
+
+			//Only destinations equal so far are passed on
+			memset(&r, 0, sizeof(r));
+			r.r.src_offset = off;
+			r.r.src_length = len;
+			for(i = first, k = 0; i < first + n; i++){
+				if(status[i] != DD_SAME)
+					continue;
+
+				r.info[k].dest_fd = dst[i];
+				r.info[k].dest_offset = off;
+				idx[k++] = i;
+			}
+			if(k == 0)
+				break;
+			r.r.dest_count = k;
+
+			if(ioctl(src, FIDEDUPERANGE, &r) != 0){
+				err = -errno;
+				for(i = first; i < cnt; i++)
+					status[i] = DD_FAILED;
+				return err;
+			}
+
+			//Shorter range is not retried, destination is left partly shared
+			for(i = 0; i < k; i++){
+				if(r.info[i].status == FILE_DEDUPE_RANGE_DIFFERS)
+					status[idx[i]] = DD_DIFFERS;
+				else if(r.info[i].status < 0)
+					status[idx[i]] = r.info[i].status;
+				else if(r.info[i].bytes_deduped != len)
+					status[idx[i]] = -EAGAIN;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+int dd_link(const char *src, const char *dst)
+{
+	char tmp[PATH_MAX];
+	struct stat s_st, d_st;
+	int len, status;
+
+	//Renaming a link over another link of the same inode does nothing
+	if(lstat(src, &s_st) != 0 || lstat(dst, &d_st) != 0)
+		return -errno;
+	if(s_st.st_dev == d_st.st_dev && s_st.st_ino == d_st.st_ino)
+		return 0;
+
+	len = snprintf(tmp, sizeof(tmp), "%s.lsdup-%d-%lu", dst, getpid(),
+					__atomic_add_fetch(&dd_seq, 1, __ATOMIC_RELAXED));
+	if(len < 0 || len >= sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	if(link(src, tmp) != 0)
+		return -errno;
+
+	if(rename(tmp, dst) != 0){
+		status = -errno;
+		unlink(tmp);
+		return status;
+	}
+
+	return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * Deduplication of equal files
+ * Reference: https://man7.org/linux/man-pages/man2/ioctl_fideduperange.2.html
+ *
+ * Filesystem is asked to share extents of a source file with its
+ * destinations. It compares ranges itself while holding them locked, so a
+ * destination it found equal needs not be read at all. Destinations are
+ * passed in batches of DD_DESTS_PER_CALL, ranges of DD_RANGE_SIZE at once.
+ *
+ * On filesystems which can't share extents, equal files are replaced by hard
+ * links to the source instead.
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#ifndef __DEDUPE_H
+#define __DEDUPE_H
+
+#include <stdint.h>
+
+#define DD_DESTS_PER_CALL		64
+#define DD_RANGE_SIZE			(16 * 1048576)	//Deduplicated in full by every filesystem
+
+//Status of a destination
+#define DD_SAME					0
+#define DD_DIFFERS				1
+#define DD_FAILED				2	//Whole request failed, see return value
+
+
+/*
+ * Share extents of a source file with destinations equal to it in content
+ *
+ * Destination is compared range by range, so it may end up sharing a part
+ * of its extents even if it differs.
+ *
+ * Arguments:
+ *		src    - descriptor of source file
+ *		size   - size of source and every destination
+ *		dst    - descriptors of destinations
+ *		status - filled in for every destination: DD_SAME, DD_DIFFERS,
+ *		         DD_FAILED or negative error code of the destination alone
+ *		cnt    - number of destinations
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - if request failed as a whole, for example when
+ *		                      filesystem can't share extents. Status of
+ *		                      remaining destinations is DD_FAILED
+ */
+int dd_extents(int src, uint64_t size, const int *dst, int *status, uint32_t cnt);
+
+
+/*
+ * Replace a file with a hard link to another one
+ *
+ * Link is made under a temporary name in the same directory and renamed
+ * over the file, so the name is never left missing. Nothing is done if both
+ * are links of the same inode already.
+ *
+ * Arguments:
+ *		src - file to link to
+ *		dst - file to be replaced
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - on failure, file is left as it was
+ */
+int dd_link(const char *src, const char *dst);
+
+
+#endif
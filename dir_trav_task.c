@@ -7,9 +7,12 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <string.h>
@@ -19,162 +22,601 @@
 #include "lf_map.h"
 #include "mpmc_lf_queue.h"
 #include "dir_trav_task.h"
+#include "calc_hash_task.h"
+#include "size_agg.h"
+#include "uring_stat.h"
 #include "file_desc.h"
+#include "obj_cache.h"
+#include "snapshot.h"
+#include "watch.h"
 
 
 struct dtt_arg {
+	struct tp_task task;
 	struct thread_pool *tp;
 	struct map *m;
-	DIR *dir;
-	int recursive;
+	struct size_agg *sa;
+	int dfd;
+	int flags;
+	int path_len;
+	int sep;
+	uint32_t ss_id;
+	volatile int refcnt;
+	unsigned long entries;
+	unsigned long syscalls;
 	char path[];
 };
 
+//Batch of files of a directory to be stat'ed, possibly by another thread.
+//Each batch holds a reference to the directory, keeping its descriptor open
+struct dtt_files {
+	struct tp_task task;
+	struct dtt_arg *dir;
+	unsigned long syscalls;
+	int cnt;
+	int used;
+	char *name[DTT_BATCH_FILES];
+	char names[DTT_BATCH_NAMES];
+};
+
+//Directory entry as returned by getdents64
+struct dtt_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static struct dtt_stats dtt_stats;
+
+//Files with more than one hard link, keyed by device and inode
+static struct map *dtt_inodes;
+
+//Directory descriptors opened by parents and held by queued tasks
+static volatile int dtt_queued_fds;
+
 
 void dtt_worker(void *_arg);
 
 
-static void dtt_handle_file(struct dtt_arg *arg, struct dirent *f)
+//Key of a file in inode map. Keys of different inodes may collide,
+//so devices and inodes of found files still have to be compared
+static uint64_t dtt_inode_key(uint64_t dev, uint64_t ino)
+{
+	uint64_t k = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+
+	return k & ~(1ULL << 63);
+}
+
+
+//Attach file to an already seen file of the same inode
+static int dtt_add_alias(struct file_desc *fd)
 {
+	struct file_desc *rep;
+
+	rep = map_find(dtt_inodes, dtt_inode_key(fd->dev, fd->ino));
+	if(rep == NULL || rep->dev != fd->dev || rep->ino != fd->ino)
+		return 0;
+
+	fd->next = __atomic_load_n(&rep->aliases, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&rep->aliases, &fd->next, fd, 0,
+										__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	__atomic_add_fetch(&dtt_stats.links, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+
+static void dtt_add_file(struct dtt_arg *arg, struct us_entry *e)
+{
+	char *name = e->name;
+	uint64_t size = e->size;
+
+	if(arg->flags & DTT_SNAPSHOT)
+		ss_log_file(arg->ss_id, e);
+
 	//get memory for a pathname
-	int off = 0;
-	int pathname_len = strlen(arg->path);
-	int filename_len = strlen(f->d_name);
-	struct file_desc *fd = calloc(1, sizeof(*fd) + pathname_len + filename_len + 2);
+	int filename_len = strlen(name);
+	struct file_desc *fd = calloc(1, sizeof(*fd) + arg->path_len + filename_len + 2);
 	if(fd ==  NULL){
 		fprintf(stderr, "Error: %s\n", strerror(ENOMEM));
 		return;
 	}
 
-	//format full pathname
-	memcpy(fd->filename, arg->path, pathname_len);
-	if(arg->path[pathname_len - 1] != '/'){
-		fd->filename[pathname_len] = '/';
-		off = 1;
-	}
-	memcpy(fd->filename + pathname_len + off, f->d_name, filename_len);
-	fd->filename[pathname_len + off + filename_len] = 0;
+	//format full pathname, needed only for opening and output later
+	memcpy(fd->filename, arg->path, arg->path_len);
+	if(arg->sep)
+		fd->filename[arg->path_len] = '/';
+	memcpy(fd->filename + arg->path_len + arg->sep, name, filename_len + 1);
 
-	//stat the file to figure out its size
-	struct stat fs;
-	if(stat(fd->filename, &fs) != 0){
-		fprintf(stderr, "Error: %s: %s\n", fd->filename, strerror(errno));
-		free(fd);
+	fd->size = size;
+	fd->dev = e->dev;
+	fd->ino = e->ino;
+	fd->mtime = e->mtime;
+	fd->ctime = e->ctime;
+
+	//Hard link to a file we already have is never read on its own
+	if(e->nlink > 1 && dtt_add_alias(fd))
 		return;
-	}
 
-	fd->size = fs.st_size;
+	//keep file in thread local tables if requested
+	if(arg->sa != NULL){
+		if(sa_add(arg->sa, fd) != 0){
+			fprintf(stderr, "Error: %s: %s\n", fd->filename, strerror(ENOMEM));
+			free(fd);
+			return;
+		}
+		goto INODE;
+	}
 
 	//try to find a file with the same size
 	void *eq_sz_list;
-	if((eq_sz_list = map_find(arg->m, fs.st_size)) == NULL){
+	if((eq_sz_list = map_find(arg->m, size)) == NULL){
 		eq_sz_list = MPMCQ_create();
 
 		//If adding does not succeed - it means someone else has added
-		if(map_add(arg->m, fs.st_size, eq_sz_list) != 0){
+		if(map_add(arg->m, size, eq_sz_list) != 0){
 			MPMCQ_destroy(eq_sz_list);
-			eq_sz_list = map_find(arg->m, fs.st_size);
+			eq_sz_list = map_find(arg->m, size);
 		}
 	}
 
 	//enqueue file
-	MPMCQ_enqueue(eq_sz_list, fd);
+	if(MPMCQ_enqueue(eq_sz_list, fd) != 0){
+		fprintf(stderr, "Error: %s: %s\n", fd->filename, strerror(ENOMEM));
+		free(fd);
+		return;
+	}
+
+	//start hashing of files with the same size while we keep traversing
+	cht_file_added(arg->tp, eq_sz_list, fd);
+
+INODE:
+	//Let later links find this file. If another link got there first,
+	//both files stay on their own and are compared as usual
+	if(e->nlink > 1)
+		map_add(dtt_inodes, dtt_inode_key(fd->dev, fd->ino), fd);
+
+	return;
+}
+
+
+static void dtt_add_stat(struct dtt_arg *arg, char *name, struct stat *fs)
+{
+	struct us_entry e;
+
+	e.name = name;
+	e.size = fs->st_size;
+	e.dev = fs->st_dev;
+	e.ino = fs->st_ino;
+	e.nlink = fs->st_nlink;
+	e.mtime = fs->st_mtim.tv_sec * 1000000000LL + fs->st_mtim.tv_nsec;
+	e.ctime = fs->st_ctim.tv_sec * 1000000000LL + fs->st_ctim.tv_nsec;
+
+	dtt_add_file(arg, &e);
+
+	return;
+}
+
+
+static void dtt_handle_file(struct dtt_files *f, char *name)
+{
+	struct dtt_arg *arg = f->dir;
+
+	//stat the file relative to its directory to figure out its size
+	struct stat fs;
+	f->syscalls++;
+	if(fstatat(arg->dfd, name, &fs, AT_SYMLINK_NOFOLLOW) != 0){
+		fprintf(stderr, "Error: %s%s%s: %s\n", arg->path, arg->sep ? "/" : "",
+				name, strerror(errno));
+		return;
+	}
+
+	dtt_add_stat(arg, name, &fs);
 
 	return;
 }
 
 
-static void dtt_handle_dir(struct dtt_arg *arg, struct dirent *d)
+//Stat a batch of files at once and add them
+static void dtt_handle_uring(struct dtt_files *f, struct us_entry *batch, int cnt)
 {
-	if(!arg->recursive)
+	struct dtt_arg *arg = f->dir;
+	int i, status;
+
+	//Stat synchronously if io_uring is not usable
+	status = us_stat_batch(arg->dfd, batch, cnt);
+	if(status < 0){
+		for(i = 0; i < cnt; i++)
+			dtt_handle_file(f, batch[i].name);
+		return;
+	}
+	f->syscalls += status;
+
+	for(i = 0; i < cnt; i++){
+		//Request may be refused by ring even though file is fine
+		if(batch[i].status == -EINVAL || batch[i].status == -EOPNOTSUPP){
+			dtt_handle_file(f, batch[i].name);
+			continue;
+		}
+
+		if(batch[i].status != 0){
+			fprintf(stderr, "Error: %s%s%s: %s\n", arg->path, arg->sep ? "/" : "",
+					batch[i].name, strerror(-batch[i].status));
+			continue;
+		}
+
+		dtt_add_file(arg, &batch[i]);
+	}
+
+	return;
+}
+
+
+//Drop a reference to a directory, closing it once nobody needs it
+static void dtt_put(struct dtt_arg *arg)
+{
+	if(__atomic_sub_fetch(&arg->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	if(arg->dfd >= 0){
+		__atomic_add_fetch(&dtt_stats.syscalls, 1, __ATOMIC_RELAXED);
+		close(arg->dfd);
+	}
+	oc_free(arg);
+
+	return;
+}
+
+
+void dtt_files_worker(void *_arg)
+{
+	struct dtt_files *f = _arg;
+	struct us_entry batch[US_RING_ENTRIES];
+	int i, cnt;
+
+	//Stat files one by one, or in io_uring batches if requested
+	if(!(f->dir->flags & DTT_URING)){
+		for(i = 0; i < f->cnt; i++)
+			dtt_handle_file(f, f->name[i]);
+	} else {
+		for(i = 0; i < f->cnt; i += cnt){
+			for(cnt = 0; cnt < US_RING_ENTRIES && i + cnt < f->cnt; cnt++)
+				batch[cnt].name = f->name[i + cnt];
+			dtt_handle_uring(f, batch, cnt);
+		}
+	}
+
+	__atomic_add_fetch(&dtt_stats.syscalls, f->syscalls, __ATOMIC_RELAXED);
+	dtt_put(f->dir);
+	oc_free(f);
+
+	return;
+}
+
+
+static struct dtt_files *dtt_files_create(struct dtt_arg *arg)
+{
+	struct dtt_files *f = oc_alloc(sizeof(*f));
+	if(f == NULL)
+		return NULL;
+
+	__atomic_add_fetch(&arg->refcnt, 1, __ATOMIC_RELAXED);
+	f->dir = arg;
+	f->syscalls = 0;
+	f->cnt = 0;
+	f->used = 0;
+
+	return f;
+}
+
+
+//Let other threads stat a full batch while directory reading goes on
+static void dtt_files_submit(struct dtt_files *f)
+{
+	f->task.task = dtt_files_worker;
+	f->task.arg = f;
+	f->task.pool_owned = 0;
+	if(tp_enqueue(f->dir->tp, &f->task) != 0)
+		dtt_files_worker(f);
+
+	return;
+}
+
+
+static void dtt_files_add(struct dtt_arg *arg, struct dtt_files **f, char *name)
+{
+	int len = strlen(name) + 1;
+
+	//Hand over full batch and start a new one
+	if(*f != NULL && ((*f)->cnt == DTT_BATCH_FILES ||
+			(*f)->used + len > DTT_BATCH_NAMES)){
+		dtt_files_submit(*f);
+		*f = NULL;
+	}
+
+	if(*f == NULL && (*f = dtt_files_create(arg)) == NULL){
+		fprintf(stderr, "Error: %s%s%s: %s\n", arg->path, arg->sep ? "/" : "",
+				name, strerror(ENOMEM));
+		return;
+	}
+
+	(*f)->name[(*f)->cnt++] = memcpy((*f)->names + (*f)->used, name, len);
+	(*f)->used += len;
+
+	return;
+}
+
+
+static void dtt_handle_dir(struct dtt_arg *arg, char *name)
+{
+	//Subdirectories are logged even if not descended into, so that
+	//snapshot stays usable for recursive runs
+	if(arg->flags & DTT_SNAPSHOT)
+		ss_log_subdir(arg->ss_id, name);
+
+	if(!(arg->flags & DTT_RECURSIVE))
 		return;
 
 	struct dtt_arg *n_arg;
+	int name_len = strlen(name), status;
 
 	//allocate buffer for new taskarg. Also include string sizes
-	n_arg = malloc(sizeof(*n_arg) + strlen(arg->path) + strlen(d->d_name) + 2);
-	if(n_arg == NULL)
+	n_arg = oc_alloc(sizeof(*n_arg) + arg->path_len + name_len + 2);
+	if(n_arg == NULL){
+		fprintf(stderr, "Error: %s%s%s: %s\n", arg->path, arg->sep ? "/" : "",
+				name, strerror(ENOMEM));
 		return;
+	}
 
 	//fill in taskarg struct
 	n_arg->tp = arg->tp;
 	n_arg->m = arg->m;
-	n_arg->recursive = arg->recursive;
-	n_arg->dir = NULL;
-	strcpy(n_arg->path, arg->path);
-	if(arg->path[strlen(arg->path) - 1] != '/')
-		strcat(n_arg->path, "/");
-	strcat(n_arg->path, d->d_name);
+	n_arg->sa = arg->sa;
+	n_arg->flags = arg->flags;
+	n_arg->refcnt = 1;
+	n_arg->entries = 0;
+	n_arg->syscalls = 0;
+	memcpy(n_arg->path, arg->path, arg->path_len);
+	if(arg->sep)
+		n_arg->path[arg->path_len] = '/';
+	memcpy(n_arg->path + arg->path_len + arg->sep, name, name_len + 1);
+	n_arg->path_len = arg->path_len + arg->sep + name_len;
+	n_arg->sep = 1;
+
+	//Open directory relative to the parent while it is at hand. Number of
+	//such descriptors is capped, others are opened by full path later
+	n_arg->dfd = -1;
+	if(__atomic_add_fetch(&dtt_queued_fds, 1, __ATOMIC_RELAXED) <= DTT_MAX_QUEUED_FDS){
+		arg->syscalls++;
+		n_arg->dfd = openat(arg->dfd, name,
+							O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	}
+	if(n_arg->dfd < 0)
+		__atomic_sub_fetch(&dtt_queued_fds, 1, __ATOMIC_RELAXED);
 
 	//Enqueue directory reading tasks for all threads
-	tp_enqueueTask(n_arg->tp, dtt_worker, n_arg);
+	n_arg->task.task = dtt_worker;
+	n_arg->task.arg = n_arg;
+	n_arg->task.pool_owned = 0;
+	if((status = tp_enqueue(n_arg->tp, &n_arg->task)) != 0){
+		fprintf(stderr, "Error: %s: %s\n", n_arg->path, strerror(-status));
+		if(n_arg->dfd >= 0){
+			close(n_arg->dfd);
+			__atomic_sub_fetch(&dtt_queued_fds, 1, __ATOMIC_RELAXED);
+		}
+		oc_free(n_arg);
+	}
 
 	return;
 }
 
 
+//Resolve entry of unknown type. Stat result is reused for file size
+static void dtt_handle_unknown(struct dtt_arg *arg, char *name)
+{
+	struct stat fs;
+
+	arg->syscalls++;
+	if(fstatat(arg->dfd, name, &fs, AT_SYMLINK_NOFOLLOW) != 0){
+		fprintf(stderr, "Error: %s%s%s: %s\n", arg->path, arg->sep ? "/" : "",
+				name, strerror(errno));
+		return;
+	}
+
+	if(S_ISDIR(fs.st_mode))
+		dtt_handle_dir(arg, name);
+
+	if(S_ISREG(fs.st_mode))
+		dtt_add_stat(arg, name, &fs);
+
+	return;
+}
+
+
+//Log directory into snapshot and replay it, if it did not change since
+//previous one. Return 1 if directory does not need to be read
+static int dtt_snapshot_dir(struct dtt_arg *arg)
+{
+	struct ss_dir *d;
+	struct stat st;
+	uint32_t i;
+
+	//Directory is still logged, but never reused on the next run
+	arg->syscalls++;
+	if(fstat(arg->dfd, &st) != 0){
+		fprintf(stderr, "Error: %s: %s\n", arg->path, strerror(errno));
+		memset(&st, 0, sizeof(st));
+		arg->ss_id = ss_log_dir(arg->path, &st);
+		return 0;
+	}
+
+	arg->ss_id = ss_log_dir(arg->path, &st);
+
+	d = ss_find_dir(arg->path, &st);
+	if(d == NULL)
+		return 0;
+
+	for(i = 0; i < d->dir_cnt; i++)
+		dtt_handle_dir(arg, d->dirs[i]);
+
+	for(i = 0; i < d->file_cnt; i++)
+		dtt_add_file(arg, &d->files[i]);
+
+	arg->entries += d->dir_cnt + d->file_cnt;
+	__atomic_add_fetch(&dtt_stats.reused, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+
 void dtt_worker(void *_arg)
 {
 	struct dtt_arg *arg = _arg;
-	struct dirent d_buff, *d;
-	int status;
+	struct dtt_files *files = NULL;
+	struct dtt_dirent64 *d;
+	long n, off;
+	char *buf;
+
+	//Take over descriptor opened by parent, or fall back to full path.
+	//Subdirectory may have been replaced by a symlink meanwhile
+	if(arg->dfd >= 0){
+		__atomic_sub_fetch(&dtt_queued_fds, 1, __ATOMIC_RELAXED);
+	} else {
+		arg->syscalls++;
+		arg->dfd = open(arg->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if(arg->dfd < 0){
+			fprintf(stderr, "Error: %s: %s\n", arg->path, strerror(errno));
+			goto DONE;
+		}
+	}
 
-	arg->dir = opendir(arg->path);
-	if(arg->dir == NULL){
-		fprintf(stderr, "Error: %s: %s\n", arg->path, strerror(errno));
-		return;
+	if((arg->flags & DTT_SNAPSHOT) && dtt_snapshot_dir(arg))
+		goto DONE;
+
+	//Watch is set up before reading, so that no later change is missed
+	if(arg->flags & DTT_WATCH)
+		wt_watch_dir(arg->path);
+
+	//Entries are read in bulk into a buffer owned by this thread
+	buf = oc_scratch(OC_SCRATCH_DENTS, DTT_DENTS_BUF_SIZE);
+	if(buf == NULL){
+		fprintf(stderr, "Error: %s: %s\n", arg->path, strerror(ENOMEM));
+		goto DONE;
 	}
 
 	while(1){
-		//Read entry
-		if((status = readdir_r(arg->dir, &d_buff, &d)) != 0)
-			break;
-		if(d == NULL)
+		arg->syscalls++;
+		n = syscall(SYS_getdents64, arg->dfd, buf, DTT_DENTS_BUF_SIZE);
+		if(n < 0)
+			fprintf(stderr, "Error: %s: %s\n", arg->path, strerror(errno));
+		if(n <= 0)
 			break;
 
-		if(strcmp(".", d->d_name) == 0)
-			continue;
-		if(strcmp("..", d->d_name) == 0)
-			continue;
+		for(off = 0; off < n; off += d->d_reclen){
+			d = (struct dtt_dirent64 *)(buf + off);
 
-		//Handle new directory
-		if(d->d_type == DT_DIR)
-			dtt_handle_dir(arg, d);
+			//Skip "." and ".."
+			if(d->d_name[0] == '.' && (d->d_name[1] == 0 ||
+					(d->d_name[1] == '.' && d->d_name[2] == 0)))
+				continue;
 
-		//Handle new file
-		if(d->d_type == DT_REG)
-			dtt_handle_file(arg, d);
+			arg->entries++;
+
+			//Handle new directory
+			if(d->d_type == DT_DIR)
+				dtt_handle_dir(arg, d->d_name);
+
+			//Collect new file. Full batches are stat'ed by other threads
+			if(d->d_type == DT_REG)
+				dtt_files_add(arg, &files, d->d_name);
+
+			//Filesystem does not report type, so find it out ourselves
+			if(d->d_type == DT_UNKNOWN)
+				dtt_handle_unknown(arg, d->d_name);
+		}
 	}
 
-	if(status != 0)
-		fprintf(stderr, "Error: %s: %s\n", arg->path, strerror(status));
+	//Stat the last batch ourselves
+	if(files != NULL)
+		dtt_files_worker(files);
 
-	closedir(arg->dir);
-	free(arg);
+DONE:
+	__atomic_add_fetch(&dtt_stats.entries, arg->entries, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dtt_stats.syscalls, arg->syscalls, __ATOMIC_RELAXED);
+	dtt_put(arg);
 
 	return;
 }
 
 
-int dtt_start(char *path, struct thread_pool *tp, struct map *m, int recursive)
+int dtt_start(char *path, struct thread_pool *tp, struct map *m,
+				struct size_agg *sa, int flags)
 {
-	struct dtt_arg *arg = malloc(sizeof(*arg) + strlen(path) + 1);
+	struct dtt_arg *arg;
+
+	if(dtt_inodes == NULL && (dtt_inodes = map_create()) == NULL)
+		return -ENOMEM;
+
+	arg = oc_alloc(sizeof(*arg) + strlen(path) + 1);
 	if(arg == NULL)
 		return -ENOMEM;
 
 	//Fill in data
 	arg->tp = tp;
 	arg->m = m;
-	arg->recursive = recursive;
-	arg->dir = NULL;
+	arg->sa = sa;
+	arg->flags = flags;
+	arg->refcnt = 1;
+	arg->entries = 0;
+	arg->syscalls = 0;
 	strcpy(arg->path, path);
+	arg->path_len = strlen(path);
+	arg->sep = arg->path_len == 0 || path[arg->path_len - 1] != '/';
+
+	//Directory given to start at may be a symlink, unlike those found inside
+	arg->dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(arg->dfd >= 0)
+		__atomic_add_fetch(&dtt_queued_fds, 1, __ATOMIC_RELAXED);
 
 	//Enqueue directory reading tasks for all threads
-	tp_enqueueTask(arg->tp, dtt_worker, arg);
+	arg->task.task = dtt_worker;
+	arg->task.arg = arg;
+	arg->task.pool_owned = 0;
+	if(tp_enqueue(arg->tp, &arg->task) != 0){
+		if(arg->dfd >= 0){
+			close(arg->dfd);
+			__atomic_sub_fetch(&dtt_queued_fds, 1, __ATOMIC_RELAXED);
+		}
+		oc_free(arg);
+		return -ENOMEM;
+	}
 
 	return 0;
 }
 
 
+void dtt_get_stats(struct dtt_stats *s)
+{
+	s->entries = __atomic_load_n(&dtt_stats.entries, __ATOMIC_RELAXED);
+	s->syscalls = __atomic_load_n(&dtt_stats.syscalls, __ATOMIC_RELAXED);
+	s->links = __atomic_load_n(&dtt_stats.links, __ATOMIC_RELAXED);
+	s->reused = __atomic_load_n(&dtt_stats.reused, __ATOMIC_RELAXED);
+
+	return;
+}
+
 
+void dtt_finish(void)
+{
+	if(dtt_inodes == NULL)
+		return;
+
+	map_discard(dtt_inodes);
+	dtt_inodes = NULL;
 
+	return;
+}
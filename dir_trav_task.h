@@ -12,25 +12,69 @@
 
 #include "thread_pool.h"
 #include "lf_map.h"
+#include "size_agg.h"
+
+
+#define DTT_MAX_QUEUED_FDS			256	//Directory descriptors held by queued tasks
+#define DTT_DENTS_BUF_SIZE			131072	//Per thread buffer for getdents64
+#define DTT_BATCH_FILES				128		//Max files in a single stat batch
+#define DTT_BATCH_NAMES				6144	//Bytes for names of a stat batch
+
+//Traversal flags
+#define DTT_RECURSIVE				(1 << 0)	//Descend into subdirectories
+#define DTT_URING					(1 << 1)	//Stat files in io_uring batches
+#define DTT_SNAPSHOT				(1 << 2)	//Log tree into snapshot, reuse its
+												//unchanged directories
+#define DTT_WATCH					(1 << 3)	//Watch every directory read
+
+//Traversal counters, accumulated over all directories
+struct dtt_stats {
+	unsigned long entries;
+	unsigned long syscalls;
+	unsigned long links;
+	unsigned long reused;		//Directories replayed from snapshot
+};
 
 
 /*
  * Start concurrent Directory Traversing Task
  *
  * This task will traverse directory under *path and will add each file into
- * *map with key value equal to file size
+ * *map with key value equal to file size. If *sa is supplied, files are
+ * aggregated in thread local tables instead and *m is not used.
+ * Hard links to an inode already seen are attached to the first file found
+ * as its aliases, instead of being added on their own
  *
  * Arguments:
  *		path      - path to start traversing
  *		tp        - thread pool for concurrency handling
  *		m         - map to add files to
- *		recursive - if scan should be recursive supply 1 here, otherwise 0
+ *		sa        - thread local aggregation to add files to, or NULL
+ *		flags     - DTT_RECURSIVE, DTT_URING, DTT_SNAPSHOT and DTT_WATCH bits,
+ *		            or 0
  *
  * Return:
  *		0                   - on success
  *		negative error code - on failure
  */
-int dtt_start(char *path, struct thread_pool *tp, struct map *m, int recursive);
+int dtt_start(char *path, struct thread_pool *tp, struct map *m,
+				struct size_agg *sa, int flags);
+
+
+/*
+ * Get traversal counters
+ *
+ * Arguments:
+ *		s - structure to fill with entries seen and system calls made so far
+ */
+void dtt_get_stats(struct dtt_stats *s);
+
+
+/*
+ * Release state kept for traversal. Must be called once traversal is done
+ * and before files are moved out of the map or thread local tables
+ */
+void dtt_finish(void);
 
 
 #endif
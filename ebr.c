@@ -0,0 +1,205 @@
+/*
+ * Epoch based memory reclamation for lock free structures
+ * Reference: https://www.cl.cam.ac.uk/techreports/UCAM-CL-TR-579.pdf
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "ebr.h"
+#include "obj_cache.h"
+
+#define LOAD(ptr)				__atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define STORE(ptr, val)			__atomic_store_n(ptr, val, __ATOMIC_SEQ_CST)
+#define CAS(ptr, expected, desired) __atomic_compare_exchange_n(ptr, \
+														expected, \
+														desired, \
+														0, \
+														__ATOMIC_SEQ_CST, \
+														__ATOMIC_SEQ_CST)
+
+//Thread state word: observed epoch shifted left, lowest bit means active
+#define EBR_ACTIVE				1UL
+#define EBR_STATE(epoch)		(((epoch) << 1) | EBR_ACTIVE)
+#define EBR_STATE_EPOCH(s)		((s) >> 1)
+
+struct ebr_item {
+	void *p;
+	void (*free_fn)(void *);
+	struct ebr_item *next;
+};
+
+//Per thread record. Records are never released, exited threads leave
+//theirs for reuse together with nodes still waiting for release
+struct ebr_rec {
+	volatile unsigned long state;
+	volatile int in_use;
+	int nest;
+	unsigned int retired;
+	struct ebr_item *limbo[EBR_EPOCHS];
+	unsigned long limbo_epoch[EBR_EPOCHS];
+	struct ebr_rec *next;
+};
+
+static volatile unsigned long ebr_epoch;
+static struct ebr_rec *ebr_recs;
+static __thread struct ebr_rec *ebr_self;
+
+static pthread_key_t ebr_key;
+static pthread_once_t ebr_key_once = PTHREAD_ONCE_INIT;
+
+
+//Leave record for other threads on thread exit
+static void ebr_rec_release(void *arg)
+{
+	struct ebr_rec *r = arg;
+
+	STORE(&r->state, 0);
+	STORE(&r->in_use, 0);
+
+	return;
+}
+
+
+static void ebr_key_create(void)
+{
+	pthread_key_create(&ebr_key, ebr_rec_release);
+}
+
+
+static struct ebr_rec *ebr_register(void)
+{
+	struct ebr_rec *r, *head;
+	int unused;
+
+	//Try to adopt record of exited thread
+	for(r = LOAD(&ebr_recs); r != NULL; r = r->next){
+		unused = 0;
+		if(LOAD(&r->in_use) == 0 && CAS(&r->in_use, &unused, 1))
+			goto DONE;
+	}
+
+	//Allocate and publish a new record
+	r = calloc(1, sizeof(*r));
+	if(r == NULL){
+		fprintf(stderr, "Out of Memory\n");
+		abort();
+	}
+	r->in_use = 1;
+
+	head = LOAD(&ebr_recs);
+	do {
+		r->next = head;
+	} while(!CAS(&ebr_recs, &head, r));
+
+DONE:
+	pthread_once(&ebr_key_once, ebr_key_create);
+	pthread_setspecific(ebr_key, r);
+	ebr_self = r;
+
+	return r;
+}
+
+
+//Release all nodes in a limbo list
+static void ebr_free_list(struct ebr_item *i)
+{
+	struct ebr_item *tmp;
+
+	while(i != NULL){
+		tmp = i;
+		i = i->next;
+
+		tmp->free_fn(tmp->p);
+		oc_free(tmp);
+	}
+
+	return;
+}
+
+
+//Advance global epoch if all active threads have observed current one
+static void ebr_try_advance(void)
+{
+	unsigned long s, epoch = LOAD(&ebr_epoch);
+	struct ebr_rec *r;
+
+	for(r = LOAD(&ebr_recs); r != NULL; r = r->next){
+		s = LOAD(&r->state);
+		if((s & EBR_ACTIVE) && EBR_STATE_EPOCH(s) != epoch)
+			return;
+	}
+
+	CAS(&ebr_epoch, &epoch, epoch + 1);
+
+	return;
+}
+
+
+void ebr_enter(void)
+{
+	struct ebr_rec *r = ebr_self;
+	if(r == NULL)
+		r = ebr_register();
+
+	if(r->nest++ != 0)
+		return;
+
+	//Announce epoch we are reading in
+	STORE(&r->state, EBR_STATE(LOAD(&ebr_epoch)));
+
+	return;
+}
+
+
+void ebr_exit(void)
+{
+	struct ebr_rec *r = ebr_self;
+
+	if(--r->nest != 0)
+		return;
+
+	__atomic_store_n(&r->state, 0, __ATOMIC_RELEASE);
+
+	return;
+}
+
+
+void ebr_retire(void *p, void (*free_fn)(void *))
+{
+	struct ebr_item *i;
+	unsigned long epoch, slot;
+	struct ebr_rec *r = ebr_self;
+	if(r == NULL)
+		r = ebr_register();
+
+	i = oc_alloc(sizeof(*i));
+	if(i == NULL){
+		//Better to leak than to release node still in use
+		fprintf(stderr, "Out of Memory\n");
+		return;
+	}
+	i->p = p;
+	i->free_fn = free_fn;
+
+	//Nodes retired at least EBR_EPOCHS epochs ago can't be referenced anymore
+	epoch = LOAD(&ebr_epoch);
+	slot = epoch % EBR_EPOCHS;
+	if(r->limbo_epoch[slot] != epoch){
+		ebr_free_list(r->limbo[slot]);
+		r->limbo[slot] = NULL;
+		r->limbo_epoch[slot] = epoch;
+	}
+
+	i->next = r->limbo[slot];
+	r->limbo[slot] = i;
+
+	if(++r->retired % EBR_ADVANCE_FREQ == 0)
+		ebr_try_advance();
+
+	return;
+}
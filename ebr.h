@@ -0,0 +1,42 @@
+/*
+ * Epoch based memory reclamation for lock free structures
+ * Reference: https://www.cl.cam.ac.uk/techreports/UCAM-CL-TR-579.pdf
+ *
+ * Threads access shared nodes only inside ebr_enter/ebr_exit sections.
+ * Unlinked nodes are handed to ebr_retire and released only after every
+ * thread that could have seen them has left its critical section.
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#ifndef __EBR_H
+#define __EBR_H
+
+#define EBR_EPOCHS				3
+#define EBR_ADVANCE_FREQ		64	//Retires between epoch advance attempts
+
+
+/*
+ * Enter critical section. Sections may be nested
+ */
+void ebr_enter(void);
+
+
+/*
+ * Leave critical section previously entered with ebr_enter
+ */
+void ebr_exit(void);
+
+
+/*
+ * Retire a node which is no longer reachable from the shared structure
+ *
+ * Arguments:
+ *		p       - pointer to unlinked node
+ *		free_fn - function used to release the node once it is safe
+ */
+void ebr_retire(void *p, void (*free_fn)(void *));
+
+
+#endif
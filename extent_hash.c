@@ -0,0 +1,100 @@
+/*
+ * Fingerprint of physical extent map of a file
+ * Reference: https://www.kernel.org/doc/Documentation/filesystems/fiemap.txt
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "file_desc.h"
+#include "murmur3_hash.h"
+
+#include "extent_hash.h"
+
+//Extents, location or content of which can't be compared
+#define EH_UNSTABLE_FLAGS		(FIEMAP_EXTENT_UNKNOWN | \
+									FIEMAP_EXTENT_DELALLOC | \
+									FIEMAP_EXTENT_ENCODED | \
+									FIEMAP_EXTENT_DATA_ENCRYPTED | \
+									FIEMAP_EXTENT_NOT_ALIGNED | \
+									FIEMAP_EXTENT_DATA_INLINE | \
+									FIEMAP_EXTENT_DATA_TAIL)
+
+struct eh_fiemap {
+	struct fiemap fm;
+	struct fiemap_extent fe[EH_EXTENTS_PER_CALL];
+};
+
+//Part of extent which identifies data
+struct eh_extent {
+	uint64_t logical;
+	uint64_t physical;
+	uint64_t length;
+	uint64_t flags;
+};
+
+
+int eh_calc(struct file_desc *fd, uint64_t hash[2])
+{
+	struct eh_fiemap m;
+	struct eh_extent e;
+	uint64_t start = 0;
+	int f, i, status = 0, last = 0;
+
+	f = open(fd->filename, O_RDONLY | O_CLOEXEC);
+	if(f < 0)
+		return -errno;
+
+	//Physical locations are meaningful only within a device
+	memset(hash, 0, sizeof(uint64_t) * 2);
+	murmur3(&fd->dev, sizeof(fd->dev), hash);
+
+	while(!last && start < fd->size){
+		memset(&m.fm, 0, sizeof(m.fm));
+		m.fm.fm_start = start;
+		m.fm.fm_length = fd->size - start;
+		m.fm.fm_extent_count = EH_EXTENTS_PER_CALL;
+
+		//Overwrites of shared extents are not mapped before writeback
+		m.fm.fm_flags = FIEMAP_FLAG_SYNC;
+		if(ioctl(f, FS_IOC_FIEMAP, &m) != 0){
+			status = -errno;
+			goto CLEANUP;
+		}
+
+		//Nothing is mapped past this point
+		if(m.fm.fm_mapped_extents == 0)
+			break;
+
+		for(i = 0; i < m.fm.fm_mapped_extents; i++){
+			if(m.fe[i].fe_flags & EH_UNSTABLE_FLAGS){
+				status = -EAGAIN;
+				goto CLEANUP;
+			}
+
+			e.logical = m.fe[i].fe_logical;
+			e.physical = m.fe[i].fe_physical;
+			e.length = m.fe[i].fe_length;
+			e.flags = m.fe[i].fe_flags & FIEMAP_EXTENT_UNWRITTEN;
+			murmur3(&e, sizeof(e), hash);
+
+			start = e.logical + e.length;
+			if(m.fe[i].fe_flags & FIEMAP_EXTENT_LAST)
+				last = 1;
+		}
+	}
+
+CLEANUP:
+	close(f);
+	return status;
+}
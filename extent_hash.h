@@ -0,0 +1,41 @@
+/*
+ * Fingerprint of physical extent map of a file
+ * Reference: https://www.kernel.org/doc/Documentation/filesystems/fiemap.txt
+ *
+ * Files sharing all their physical extents at the same logical offsets
+ * (reflinked copies on btrfs, XFS) have equal content, which allows to
+ * skip reading them. Extent maps are queried with FIEMAP and hashed
+ * together with device number.
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#ifndef __EXTENT_HASH_H
+#define __EXTENT_HASH_H
+
+#include <stdint.h>
+
+#include "file_desc.h"
+
+#define EH_EXTENTS_PER_CALL		64
+
+
+/*
+ * Calculate fingerprint of file's extent map
+ *
+ * Extent maps containing extents of unknown location, delayed allocation,
+ * encoded or inline data are not stable and are not fingerprinted.
+ *
+ * Arguments:
+ *		fd   - file to query, dev and size must be filled in
+ *		hash - output buffer for 128 bit fingerprint
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - if fingerprint is not available
+ */
+int eh_calc(struct file_desc *fd, uint64_t hash[2]);
+
+
+#endif
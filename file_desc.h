@@ -11,13 +11,61 @@
 #define __FILE_DESC_H
 
 #include <stdint.h>
+#include <stdlib.h>
+
+struct hc_entry;
 
 struct file_desc {
+	//Key of content hashed so far and the stage it covers
 	uint64_t hash[2];
-	int hash_valid;
+	int hash_stage;
+	volatile int hash_queued;
+
+	//Fingerprint of physical extents, if queried
+	uint64_t ext_hash[2];
+	int ext_valid;
+
+	//First file of the same size sharing all extents with this one
+	struct file_desc *ext_leader;
+
+	//Next file of the same size, when not kept in a map list,
+	//or next alias of the same inode
+	struct file_desc *next;
+
+	//Other hard links to the same inode, never read separately
+	struct file_desc *aliases;
+
+	//Cached keys of this file, if hash cache is used
+	struct hc_entry *cache;
 
-	int size;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;		//Nanoseconds
+	int64_t ctime;
 	char filename[];
 };
 
+
+//Release all aliases of a file
+static inline void fd_free_aliases(struct file_desc *fd)
+{
+	struct file_desc *tmp;
+
+	while(fd->aliases != NULL){
+		tmp = fd->aliases;
+		fd->aliases = tmp->next;
+		free(tmp);
+	}
+}
+
+
+//Release file together with its aliases
+static inline void fd_free(struct file_desc *fd)
+{
+	fd_free_aliases(fd);
+	free(fd->cache);
+	free(fd);
+}
+
 #endif
@@ -14,50 +14,25 @@
 #include "mpmc_lf_queue.h"
 #include "list_utils.h"
 #include "file_desc.h"
+#include "map_iter_task.h"
 
 #include "free_map_task.h"
 
-struct freeing_arg {
-	struct thread_pool *tp;
-	struct map *m;
-};
-
-
-void fmt_files_queue_worker(void *arg)
+//Release a single size group and remove it from the map
+static void fmt_group_free(struct node *n, void *ctx)
 {
-	struct mpmcq *q = arg;
+	struct map *m = ctx;
+	struct mpmcq *q = L_DATA(n);
 	struct file_desc *tmp;
 
 	//Release all data in queue
 	while((tmp = MPMCQ_dequeue(q)) != NULL)
-		free(tmp);
+		fd_free(tmp);
 
 	//Destroy queue
 	MPMCQ_destroy(q);
 
-	return;
-}
-
-
-void fmt_list_traverse_worker(void *_arg)
-{
-	struct freeing_arg *arg = _arg;
-
-	struct node *tmp, *n = arg->m->ST[0][0].ptr.ptr;
-	while(n != NULL){
-		tmp = n;
-		n = L_NEXT(n);
-
-		//skip null nodes
-		if(L_DATA(tmp) == NULL)
-			continue;
-
-		tp_enqueueTask(arg->tp, fmt_files_queue_worker, L_DATA(tmp));
-
-		map_rm(arg->m, L_KEY(tmp));
-	}
-
-	free(arg);
+	map_rm(m, L_KEY(n));
 
 	return;
 }
@@ -65,11 +40,6 @@ void fmt_list_traverse_worker(void *_arg)
 
 int fmt_start(struct thread_pool *tp, struct map *m)
 {
-	//fill in data for worker
-	struct freeing_arg *arg = malloc(sizeof(*arg));
-	arg->tp = tp;
-	arg->m = m;
-
-	return tp_enqueueTask(tp, fmt_list_traverse_worker, arg);
+	//Release all size groups in parallel
+	return mit_start(tp, m, fmt_group_free, m);
 }
-
@@ -0,0 +1,347 @@
+/*
+ * Persistent cache of content keys
+ * No references this time
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "file_desc.h"
+#include "size_index.h"
+
+#include "hash_cache.h"
+
+#define HC_MIN_TABLE			1024
+
+struct hash_cache {
+	char *path;
+	int valid;					//File exists and has a known format
+
+	//Mapped records
+	void *map;
+	size_t map_len;
+	struct hc_record *recs;
+	unsigned long rec_cnt;
+
+	//Latest record of every file, as record number + 1 or 0 if slot is free
+	unsigned long *table;
+	unsigned long mask;
+	unsigned long live;
+};
+
+static struct hash_cache *hc;
+
+
+static unsigned long hc_hash(uint64_t dev, uint64_t ino)
+{
+	uint64_t k = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+
+	return k;
+}
+
+
+//Find slot of a file, or a free slot where it belongs
+static unsigned long *hc_slot(uint64_t dev, uint64_t ino)
+{
+	struct hc_record *r;
+	unsigned long i = hc_hash(dev, ino) & hc->mask;
+
+	while(hc->table[i] != 0){
+		r = &hc->recs[hc->table[i] - 1];
+		if(r->dev == dev && r->ino == ino)
+			break;
+		i = (i + 1) & hc->mask;
+	}
+
+	return &hc->table[i];
+}
+
+
+//Map cache file and index its records, later records superseding earlier ones
+static int hc_load(void)
+{
+	struct hc_header *h;
+	struct stat st;
+	unsigned long i, *slot;
+	int f;
+
+	f = open(hc->path, O_RDONLY | O_CLOEXEC);
+	if(f < 0)
+		return errno == ENOENT ? 0 : -errno;
+
+	if(fstat(f, &st) != 0 || st.st_size < sizeof(*h)){
+		close(f);
+		return 0;
+	}
+
+	hc->map_len = st.st_size;
+	hc->map = mmap(NULL, hc->map_len, PROT_READ, MAP_PRIVATE, f, 0);
+	close(f);
+	if(hc->map == MAP_FAILED){
+		hc->map = NULL;
+		return -errno;
+	}
+
+	h = hc->map;
+	if(memcmp(h->magic, HC_MAGIC, sizeof(h->magic)) != 0 ||
+			h->version != HC_VERSION || h->record_size != sizeof(struct hc_record)){
+		fprintf(stderr, "Warning: %s: unknown hash cache format, "
+				"it will be rewritten\n", hc->path);
+		return 0;
+	}
+
+	//Partly written record at the end is ignored
+	hc->valid = 1;
+	hc->recs = (struct hc_record *)(h + 1);
+	hc->rec_cnt = (hc->map_len - sizeof(*h)) / sizeof(struct hc_record);
+	madvise(hc->map, hc->map_len, MADV_WILLNEED);
+
+	hc->mask = HC_MIN_TABLE - 1;
+	while(hc->mask + 1 < hc->rec_cnt * 2)
+		hc->mask = hc->mask * 2 + 1;
+
+	free(hc->table);
+	hc->table = calloc(hc->mask + 1, sizeof(*hc->table));
+	if(hc->table == NULL)
+		return -ENOMEM;
+
+	for(i = 0; i < hc->rec_cnt; i++){
+		slot = hc_slot(hc->recs[i].dev, hc->recs[i].ino);
+		if(*slot == 0)
+			hc->live++;
+		*slot = i + 1;
+	}
+
+	return 0;
+}
+
+
+int hc_open(const char *path)
+{
+	int status;
+
+	hc = calloc(1, sizeof(*hc));
+	if(hc == NULL)
+		return -ENOMEM;
+
+	hc->path = strdup(path);
+	hc->mask = HC_MIN_TABLE - 1;
+	hc->table = calloc(hc->mask + 1, sizeof(*hc->table));
+	if(hc->path == NULL || hc->table == NULL){
+		hc_close();
+		return -ENOMEM;
+	}
+
+	status = hc_load();
+	if(status != 0)
+		hc_close();
+
+	return status;
+}
+
+
+struct hc_entry *hc_get(struct file_desc *fd)
+{
+	struct hc_entry *e;
+	struct hc_record *r;
+	unsigned long *slot;
+
+	if(hc == NULL)
+		return NULL;
+
+	if(fd->cache != NULL)
+		return fd->cache;
+
+	e = calloc(1, sizeof(*e));
+	if(e == NULL)
+		return NULL;
+
+	e->rec.dev = fd->dev;
+	e->rec.ino = fd->ino;
+	e->rec.size = fd->size;
+	e->rec.mtime = fd->mtime;
+	e->rec.ctime = fd->ctime;
+
+	//Keys are only valid while file is the same
+	slot = hc_slot(fd->dev, fd->ino);
+	if(*slot != 0){
+		r = &hc->recs[*slot - 1];
+		if(r->size == fd->size && r->mtime == fd->mtime && r->ctime == fd->ctime){
+			e->rec.stages = r->stages;
+			memcpy(e->rec.keys, r->keys, sizeof(r->keys));
+		}
+	}
+
+	fd->cache = e;
+
+	return e;
+}
+
+
+static int hc_write(int f, const void *buff, size_t len)
+{
+	ssize_t ret;
+
+	while(len > 0){
+		ret = write(f, buff, len);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0)
+			return -errno;
+
+		buff += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+
+//Write out all records, except those superseded by new ones
+static int hc_rewrite(struct hc_record *recs, unsigned long cnt)
+{
+	struct hc_header h;
+	unsigned long i, *slot;
+	uint8_t *skip;
+	char *tmp;
+	int f, status = 0;
+
+	tmp = malloc(strlen(hc->path) + 5);
+	skip = calloc(hc->rec_cnt + 1, sizeof(*skip));
+	if(tmp == NULL || skip == NULL){
+		status = -ENOMEM;
+		goto CLEANUP;
+	}
+	sprintf(tmp, "%s.tmp", hc->path);
+
+	f = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(f < 0){
+		status = -errno;
+		goto CLEANUP;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, HC_MAGIC, sizeof(h.magic));
+	h.version = HC_VERSION;
+	h.record_size = sizeof(struct hc_record);
+	status = hc_write(f, &h, sizeof(h));
+
+	//Skip old records of files written anew
+	for(i = 0; i < cnt && hc->valid; i++){
+		slot = hc_slot(recs[i].dev, recs[i].ino);
+		if(*slot != 0)
+			skip[*slot - 1] = 1;
+	}
+
+	for(i = 0; i <= hc->mask && hc->valid && status == 0; i++)
+		if(hc->table[i] != 0 && !skip[hc->table[i] - 1])
+			status = hc_write(f, &hc->recs[hc->table[i] - 1],
+								sizeof(struct hc_record));
+
+	if(status == 0)
+		status = hc_write(f, recs, sizeof(*recs) * cnt);
+
+	if(close(f) != 0 && status == 0)
+		status = -errno;
+
+	if(status == 0 && rename(tmp, hc->path) != 0)
+		status = -errno;
+
+	if(status != 0)
+		unlink(tmp);
+
+CLEANUP:
+	free(skip);
+	free(tmp);
+	return status;
+}
+
+
+int hc_save(struct size_index *idx)
+{
+	struct hc_record *recs;
+	struct hc_entry *e;
+	unsigned long i, cnt = 0;
+	int f, status;
+
+	if(hc == NULL)
+		return 0;
+
+	recs = malloc(sizeof(*recs) * (idx->file_cnt + 1));
+	if(recs == NULL)
+		return -ENOMEM;
+
+	//Gather records with keys calculated during this run
+	for(i = 0; i < idx->file_cnt; i++){
+		e = idx->files[i]->cache;
+		if(e == NULL || !e->dirty)
+			continue;
+
+		recs[cnt] = e->rec;
+		recs[cnt].reserved = 0;
+		cnt++;
+	}
+
+	//Rewrite file once superseded records would take up most of it
+	if(!hc->valid || hc->rec_cnt + cnt > (hc->live + cnt) * 2){
+		status = hc_rewrite(recs, cnt);
+		free(recs);
+		return status;
+	}
+
+	if(cnt == 0){
+		free(recs);
+		return 0;
+	}
+
+	f = open(hc->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+	if(f < 0){
+		free(recs);
+		return -errno;
+	}
+
+	//Partly written record of an interrupted run must not shift the rest
+	status = ftruncate(f, sizeof(struct hc_header) +
+						hc->rec_cnt * sizeof(struct hc_record)) != 0 ? -errno : 0;
+	if(status == 0)
+		status = hc_write(f, recs, sizeof(*recs) * cnt);
+
+	if(close(f) != 0 && status == 0)
+		status = -errno;
+
+	free(recs);
+
+	return status;
+}
+
+
+void hc_close(void)
+{
+	if(hc == NULL)
+		return;
+
+	if(hc->map != NULL)
+		munmap(hc->map, hc->map_len);
+	free(hc->table);
+	free(hc->path);
+	free(hc);
+	hc = NULL;
+
+	return;
+}
@@ -0,0 +1,102 @@
+/*
+ * Persistent cache of content keys
+ * No references this time
+ *
+ * Keys of all hashing stages are kept in a file between runs, so that files
+ * which did not change are not read again. A file is identified by device
+ * and inode, and its record is only trusted while size, mtime and ctime are
+ * the same. Cache file is a header followed by fixed size records: it is
+ * mapped into memory when opened, and records of new or changed files are
+ * appended when saved. Later record of a file supersedes earlier ones, and
+ * file is rewritten without superseded records once they take up most of it.
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#ifndef __HASH_CACHE_H
+#define __HASH_CACHE_H
+
+#include <stdint.h>
+
+#include "file_desc.h"
+#include "size_index.h"
+#include "calc_hash_task.h"
+
+#define HC_MAGIC				"LSDUPHC1"
+#define HC_VERSION				1
+
+struct hc_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+};
+
+struct hc_record {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+	int64_t ctime;
+	uint32_t stages;				//Bit of every stage, key of which is known
+	uint32_t reserved;
+	uint64_t keys[CHT_STAGES][2];
+};
+
+//Record of a file being scanned
+struct hc_entry {
+	struct hc_record rec;
+	int dirty;
+};
+
+
+/*
+ * Open cache file, creating it if it does not exist
+ *
+ * Arguments:
+ *		path - cache file path
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - on failure
+ */
+int hc_open(const char *path);
+
+
+/*
+ * Get cached keys of a file
+ *
+ * Entry is created on first call for a file and attached to it, keys are
+ * only filled in if a record of unchanged file was found. Must not be called
+ * for the same file from several threads at once.
+ *
+ * Arguments:
+ *		fd - file, dev, ino, size, mtime and ctime must be filled in
+ *
+ * Return:
+ *		NULL                   - if cache is not open or out of memory
+ *		pointer to cache entry - on success
+ */
+struct hc_entry *hc_get(struct file_desc *fd);
+
+
+/*
+ * Append records of files, keys of which were calculated, into cache file
+ *
+ * Arguments:
+ *		idx - index of files hashed during this run
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - on failure
+ */
+int hc_save(struct size_index *idx);
+
+
+/*
+ * Unmap cache file and release memory
+ */
+void hc_close(void);
+
+
+#endif
@@ -15,6 +15,8 @@
 #include <errno.h>
 
 #include "lf_map.h"
+#include "obj_cache.h"
+#include "ebr.h"
 
 static const uint8_t bitReverse256[] = 
 {
@@ -119,7 +121,7 @@ TRY_AGAIN: //Really ugly, but references suggests that....
 			s->prev = &s->cur.ptr.ptr->next;
 		} else {
 			if(CAS(&s->prev->blk, &cur_0.blk, &next_0.blk)){
-				free(cur_0.ptr.ptr);
+				ebr_retire(cur_0.ptr.ptr, oc_free);
 				s->next.ptr.tag = s->cur.ptr.tag + 1;
 			} else {
 				goto TRY_AGAIN;
@@ -136,7 +138,7 @@ int l_insert_with_findres(struct node *h, uint64_t key, uint64_t n_key, void *da
 						struct srch_status *s, struct node **new)
 {
 	//Allocate node struct
-	struct node *n = malloc(sizeof(*n));
+	struct node *n = oc_alloc(sizeof(*n));
 	if(n == NULL)
 		return -ENOMEM;
 
@@ -150,7 +152,7 @@ int l_insert_with_findres(struct node *h, uint64_t key, uint64_t n_key, void *da
 	while(1){
 		//Search for a place to insert our element
 		if(l_isInList(h, key, s)){
-			free(n);
+			oc_free(n);
 			return -EEXIST;
 		}
 
@@ -180,7 +182,7 @@ int l_insert(struct node *h, uint64_t key, uint64_t n_key, void *data)
 }
 
 
-int l_delete(struct node *h, uint64_t key)
+int l_delete(struct node *h, uint64_t key, void **data)
 {
 	struct srch_status s;
 
@@ -200,6 +202,10 @@ int l_delete(struct node *h, uint64_t key)
 		if(!CAS(&s.cur.ptr.ptr->next.blk, &tmp[0].blk, &tmp[1].blk))
 			continue;
 
+		//Node is ours now, nobody else can remove it
+		if(data != NULL)
+			*data = s.cur.ptr.ptr->data;
+
 		// Change links of linked list to skip our to-be-deleted node
 		tmp[0].ptr.ptr = s.cur.ptr.ptr;
 		tmp[0].ptr.mrk = 0;
@@ -208,7 +214,7 @@ int l_delete(struct node *h, uint64_t key)
 		tmp[1].ptr.mrk = 0;
 		tmp[1].ptr.tag = s.cur.ptr.tag + 1;
 		if(CAS(&s.prev->blk, &tmp[0].blk, &tmp[1].blk))
-			free(s.cur.ptr.ptr);
+			ebr_retire(s.cur.ptr.ptr, oc_free);
 		else
 			l_isInList(h, key, &s);
 
@@ -295,7 +301,7 @@ struct map *map_create(void)
 	memset(m->ST, 0, sizeof(m->ST));
 
 	//Create dummy node for zero bucket
-	struct node *n = malloc(sizeof(*n));
+	struct node *n = oc_alloc(sizeof(*n));
 	if(n == NULL){
 		free(m);
 		return NULL;
@@ -320,13 +326,21 @@ int map_destroy(struct map *m)
 		return -EEXIST;
 	}
 
+	map_discard(m);
+
+	return 0;
+}
+
+
+void map_discard(struct map *m)
+{
 	//first of all, free all instances of linked list
 	struct node *tmp, *n = m->ST[0][0].ptr.ptr;
 	while(n != NULL){
 		tmp = n;
 		n = n->next.ptr.ptr;
 
-		free(tmp);
+		oc_free(tmp);
 	}
 
 	//then free all indirection buffers
@@ -341,7 +355,7 @@ int map_destroy(struct map *m)
 	//release map
 	free(m);
 
-	return 0;
+	return;
 }
 
 
@@ -349,17 +363,24 @@ int map_add(struct map *m, uint64_t key, void *data)
 {
 	int ret;
 	int bucket_id = key % m->size;
-	struct node *n = get_bucket(m, bucket_id);
+	struct node *n;
+
+	ebr_enter();
+	n = get_bucket(m, bucket_id);
 
 	//If node has not been accesed before
 	if(n == NULL){
 		n = init_bucket(m, bucket_id);
-		if(n == NULL)
+		if(n == NULL){
+			ebr_exit();
 			return -ENOMEM;
+		}
 	}
 
 	//Try to find list
-	if((ret = l_insert(n, REG_KEY(key), key, data)) < 0)
+	ret = l_insert(n, REG_KEY(key), key, data);
+	ebr_exit();
+	if(ret < 0)
 		return ret;
 
 	//Take care of hash size
@@ -375,39 +396,56 @@ int map_add(struct map *m, uint64_t key, void *data)
 void *map_find(struct map *m, uint64_t key)
 {
 	int bucket_id = key % m->size;
-	struct node *n = get_bucket(m, bucket_id);
+	struct node *n;
 	struct srch_status s;
+	void *data = NULL;
+
+	ebr_enter();
+	n = get_bucket(m, bucket_id);
 
 	//If node has not been accesed before
-	if(n == NULL){
+	if(n == NULL)
 		n = init_bucket(m, bucket_id);
-		if(n == NULL)
-			return NULL;
-	}
 
 	//Try to find node
-	if(!l_isInList(n, REG_KEY(key), &s))
-		return NULL;
+	if(n != NULL && l_isInList(n, REG_KEY(key), &s))
+		data = s.cur.ptr.ptr->data;
 
-	return s.cur.ptr.ptr->data;
+	ebr_exit();
+	return data;
 }
 
 
 int map_rm(struct map *m, uint64_t key)
+{
+	void *data;
+
+	return map_take(m, key, &data);
+}
+
+
+int map_take(struct map *m, uint64_t key, void **data)
 {
 	int ret;
 	int bucket_id = key % m->size;
-	struct node *n = get_bucket(m, bucket_id);
+	struct node *n;
+
+	ebr_enter();
+	n = get_bucket(m, bucket_id);
 
 	//If node has not been accesed before
 	if(n == NULL){
 		n = init_bucket(m, bucket_id);
-		if(n == NULL)
+		if(n == NULL){
+			ebr_exit();
 			return -ENOMEM;
+		}
 	}
 
 	//Try to delete from bucket
-	if((ret = l_delete(n, REG_KEY(key))) < 0)
+	ret = l_delete(n, REG_KEY(key), data);
+	ebr_exit();
+	if(ret < 0)
 		return ret;
 
 	//decrement element counter
@@ -416,3 +454,62 @@ int map_rm(struct map *m, uint64_t key)
 }
 
 
+void *map_update(struct map *m, uint64_t key, void *data)
+{
+	int bucket_id = key % m->size;
+	struct node *n;
+	struct srch_status s;
+	void *old = NULL;
+
+	ebr_enter();
+	n = get_bucket(m, bucket_id);
+
+	//If node has not been accesed before
+	if(n == NULL)
+		n = init_bucket(m, bucket_id);
+
+	//Swap data of node in place. Node is kept alive by critical section
+	if(n != NULL && l_isInList(n, REG_KEY(key), &s))
+		old = __atomic_exchange_n(&s.cur.ptr.ptr->data, data, __ATOMIC_ACQ_REL);
+
+	ebr_exit();
+	return old;
+}
+
+
+
+
+//Get bucket head, initializing it if needed
+static struct node *map_get_bucket(struct map *m, uint64_t bucket_id)
+{
+	struct node *n = get_bucket(m, bucket_id);
+	if(n == NULL)
+		n = init_bucket(m, bucket_id);
+
+	return n;
+}
+
+
+int map_get_range(struct map *m, unsigned int depth, uint64_t idx,
+					struct map_range *r)
+{
+	if(depth >= 64 || idx >> depth != 0)
+		return -EINVAL;
+
+	ebr_enter();
+
+	//Range begins at a bucket whose reversed index has idx as prefix
+	r->begin = map_get_bucket(m, depth == 0 ? 0 : REVERSE(idx) >> (64 - depth));
+
+	//And ends where the next range begins
+	r->end = NULL;
+	if(idx + 1 < (1ULL << depth))
+		r->end = map_get_bucket(m, REVERSE(idx + 1) >> (64 - depth));
+
+	ebr_exit();
+
+	if(r->begin == NULL || (r->end == NULL && idx + 1 < (1ULL << depth)))
+		return -ENOMEM;
+
+	return 0;
+}
@@ -55,6 +55,12 @@ struct map {
 	volatile unsigned int size;
 };
 
+//Part of a map list, from begin (inclusive) to end (exclusive)
+struct map_range {
+	struct node *begin;
+	struct node *end;
+};
+
 
 /*
  * Create new map instance
@@ -79,6 +85,15 @@ struct map *map_create(void);
 int map_destroy(struct map *m);
 
 
+/*
+ * Destroy map instance together with elements still in it
+ *
+ * NOTE: this is not thread-safe, same as map_destroy. Data pointers of
+ * elements are not released
+ */
+void map_discard(struct map *m);
+
+
 /*
  * Inserts an element into hash
  * NOTE: This hash does support storing multiple elements with the same key
@@ -106,6 +121,7 @@ void *map_find(struct map *m, uint64_t key);
 
 /*
  * Deletes all elements with a given key
+ * Removed nodes are released only after all concurrent readers are done
  *
  * Arguments:
  * 		key - key value
@@ -118,6 +134,64 @@ void *map_find(struct map *m, uint64_t key);
 int map_rm(struct map *m, uint64_t key);
 
 
+/*
+ * Deletes element with a given key and hands its data over to the caller
+ * Only one of concurrent callers gets the data, so it may be released safely
+ *
+ * Arguments:
+ * 		key  - key value
+ * 		data - output for data pointer of removed element
+ *
+ * Returns:
+ * 		0                   - on success
+ * 		-ENOENT             - if there is no such element
+ * 		negative error code - on other failure
+ *
+ */
+int map_take(struct map *m, uint64_t key, void **data);
+
+
+/*
+ * Replaces data of an element with a given key
+ * NOTE: Update racing with removal of the same element may be lost together
+ * with the element
+ *
+ * Arguments:
+ * 		key  - key value
+ * 		data - new data pointer
+ *
+ * Returns:
+ * 		previous data pointer - on success
+ * 		NULL                  - if there is no such element
+ *
+ */
+void *map_update(struct map *m, uint64_t key, void *data);
+
+
+/*
+ * Get one of 2^depth disjoint ranges of the map list
+ *
+ * In split-ordered list bucket heads are sorted by bit-reversed index,
+ * thus the list can be split into contiguous parts recursively: range idx
+ * at depth d consists of ranges 2 * idx and 2 * idx + 1 at depth d + 1.
+ * Elements may be iterated while map is being modified, however, elements
+ * added concurrently may or may not be seen.
+ *
+ * NOTE: Iteration must be done within ebr_enter/ebr_exit section
+ *
+ * Arguments:
+ * 		depth - number of times list was split in halves, less than 64
+ * 		idx   - range number, less than 2^depth
+ * 		r     - range output
+ *
+ * Returns:
+ * 		0                   - on success
+ * 		negative error code - on failure
+ */
+int map_get_range(struct map *m, unsigned int depth, uint64_t idx,
+					struct map_range *r);
+
+
 #endif
 
 
@@ -21,6 +21,8 @@
 
 //Iteration
 #define L_FOREACH(item, list)	for(item = list; item != NULL; item = L_NEXT(item))
+#define L_FOREACH_RANGE(item, r)	for(item = (r)->begin; item != (r)->end; \
+											item = L_NEXT(item))
 
 #endif
 
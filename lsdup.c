@@ -13,29 +13,72 @@
 #include <time.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include "thread_pool.h"
 #include "lf_map.h"
+#include "size_index.h"
+#include "size_agg.h"
 #include "dir_trav_task.h"
 #include "calc_hash_task.h"
 #include "compare_task.h"
 #include "free_map_task.h"
+#include "output.h"
+#include "hash_cache.h"
+#include "snapshot.h"
+#include "watch.h"
 
 static char *help_text =
 "Usage: lsdup [OPTION]... [DIRECTORY]...\n"
-"List duplicate (in content) file pairs (the current directory by default).\n"
+"List duplicate (in content) files (the current directory by default).\n"
 "\n"
 "Options:\n"
 "	-t, --threads <num>         Number of threads to run\n"
 "	-r, --recursive             Scan directory recursively\n"
+"	-s, --stats                 Print time and counters of each phase to stderr\n"
+"	-u, --uring                 Stat files in batches using io_uring, if\n"
+"	                            available\n"
+"	-e, --extents               Treat files sharing all physical extents\n"
+"	                            (reflinks) as equal without reading them\n"
+"	-l, --local-agg             Group files by size in per thread tables\n"
+"	                            and merge them after traversal\n"
+"	-c, --cache <file>          Keep keys of hashed files in a cache file and\n"
+"	                            don't read files unchanged since last run\n"
+"	-S, --snapshot <file>       Keep snapshot of the tree in a file and don't\n"
+"	                            read directories unchanged since last run\n"
+"	-D, --diff <file>           Write sets of equal files which appeared or\n"
+"	                            vanished since last snapshot, needs -S\n"
+"	-d, --dedupe                Deduplicate sets of equal files: share their\n"
+"	                            extents, or replace them with hard links on\n"
+"	                            filesystems which can't\n"
+"	-w, --watch <socket>        Keep index of duplicates up to date with file\n"
+"	                            changes and answer queries at UNIX socket\n"
+"	-f, --format <fmt>          Output format: pairs (default) prints a line\n"
+"	                            per pair of equal files, text, nul and json\n"
+"	                            print a record per set of equal files\n"
 "	-h, --help                  Print this help text\n";
 
 struct params {
 	int thread_cnt;
 	int recursive;
+	int stats;
+	int local_agg;
+	int uring;
+	int extents;
+	int dedupe;
+	char *cache_path;
+	char *snapshot_path;
+	char *diff_path;
+	char *watch_path;
 	char *scan_path;
 };
 
+struct phase_stats {
+	struct timespec wall;
+	struct timeval cpu;
+};
+
 
 static int scan_params(int argc, char *argv[], struct params *p)
 {
@@ -43,6 +86,15 @@ static int scan_params(int argc, char *argv[], struct params *p)
 	p->thread_cnt = sysconf(_SC_NPROCESSORS_ONLN);
 	p->scan_path = ".";
 	p->recursive = 0;
+	p->stats = 0;
+	p->local_agg = 0;
+	p->uring = 0;
+	p->extents = 0;
+	p->dedupe = 0;
+	p->cache_path = NULL;
+	p->snapshot_path = NULL;
+	p->diff_path = NULL;
+	p->watch_path = NULL;
 
 	//Prepare for getopt
 	extern char *optarg;
@@ -55,6 +107,26 @@ static int scan_params(int argc, char *argv[], struct params *p)
 		{"r", 0, NULL, 'r'},
 		{"R", 0, NULL, 'r'},
 		{"recursive", 0, NULL, 'r'},
+		{"s", 0, NULL, 's'},
+		{"stats", 0, NULL, 's'},
+		{"u", 0, NULL, 'u'},
+		{"uring", 0, NULL, 'u'},
+		{"e", 0, NULL, 'e'},
+		{"extents", 0, NULL, 'e'},
+		{"l", 0, NULL, 'l'},
+		{"local-agg", 0, NULL, 'l'},
+		{"c", 1, NULL, 'c'},
+		{"cache", 1, NULL, 'c'},
+		{"S", 1, NULL, 'S'},
+		{"snapshot", 1, NULL, 'S'},
+		{"D", 1, NULL, 'D'},
+		{"diff", 1, NULL, 'D'},
+		{"d", 0, NULL, 'd'},
+		{"dedupe", 0, NULL, 'd'},
+		{"w", 1, NULL, 'w'},
+		{"watch", 1, NULL, 'w'},
+		{"f", 1, NULL, 'f'},
+		{"format", 1, NULL, 'f'},
 		{"h", 0, NULL, 'h'},
 		{"help", 0, NULL, 'h'},
 		{0, 0, 0, 0}
@@ -71,6 +143,48 @@ static int scan_params(int argc, char *argv[], struct params *p)
 			p->recursive = 1;
 			break;
 
+		case 's':
+			p->stats = 1;
+			break;
+
+		case 'u':
+			p->uring = 1;
+			break;
+
+		case 'e':
+			p->extents = 1;
+			break;
+
+		case 'l':
+			p->local_agg = 1;
+			break;
+
+		case 'c':
+			p->cache_path = optarg;
+			break;
+
+		case 'S':
+			p->snapshot_path = optarg;
+			break;
+
+		case 'D':
+			p->diff_path = optarg;
+			break;
+
+		case 'd':
+			p->dedupe = 1;
+			break;
+
+		case 'w':
+			p->watch_path = optarg;
+			break;
+
+		case 'f':
+			if(out_set_format(optarg) != 0){
+				fprintf(stderr, "Invalid output format: %s\n", optarg);
+				return -EINVAL;
+			}
+			break;
 
 		case 'h':
 			printf("%s\n", help_text);
@@ -88,6 +202,17 @@ static int scan_params(int argc, char *argv[], struct params *p)
 		return -EINVAL;
 	}
 
+	if(p->diff_path != NULL && p->snapshot_path == NULL){
+		fprintf(stderr, "Diff needs a snapshot to compare with\n");
+		return -EINVAL;
+	}
+
+	if(p->watch_path != NULL && (p->snapshot_path != NULL || p->local_agg || p->dedupe)){
+		fprintf(stderr, "Watch can't be combined with snapshot, local aggregation "
+				"or dedupe\n");
+		return -EINVAL;
+	}
+
 	//Check if path is specified as last argument
 	if(optind < argc)
 		p->scan_path = argv[argc - 1];
@@ -96,9 +221,163 @@ static int scan_params(int argc, char *argv[], struct params *p)
 }
 
 
+static void stats_start(struct params *p, struct phase_stats *s)
+{
+	struct rusage ru;
+
+	if(!p->stats)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &s->wall);
+	getrusage(RUSAGE_SELF, &ru);
+	timeradd(&ru.ru_utime, &ru.ru_stime, &s->cpu);
+}
+
+
+static double stats_end(struct params *p, struct phase_stats *s, char *phase)
+{
+	struct timespec wall;
+	struct timeval cpu;
+	struct rusage ru;
+	double wall_s;
+
+	if(!p->stats)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	getrusage(RUSAGE_SELF, &ru);
+	timeradd(&ru.ru_utime, &ru.ru_stime, &cpu);
+	timersub(&cpu, &s->cpu, &cpu);
+
+	wall_s = (wall.tv_sec - s->wall.tv_sec) + (wall.tv_nsec - s->wall.tv_nsec) / 1e9;
+	fprintf(stderr, "%-10s %10.6f s wall %10.6f s cpu\n", phase,
+			wall_s, cpu.tv_sec + cpu.tv_usec / 1e6);
+
+	return wall_s;
+}
+
+
+static void stats_traverse(struct params *p, double wall_s)
+{
+	struct dtt_stats ds;
+
+	if(!p->stats)
+		return;
+
+	dtt_get_stats(&ds);
+	fprintf(stderr, "%-10s %lu entries %.3f syscalls/entry %.0f entries/s "
+			"%lu hard links %lu dirs reused\n", "",
+			ds.entries, ds.entries ? (double)ds.syscalls / ds.entries : 0,
+			wall_s > 0 ? ds.entries / wall_s : 0, ds.links, ds.reused);
+}
+
+
+static void stats_hash(struct params *p)
+{
+	struct cht_stats cs;
+	int i;
+
+	if(!p->stats)
+		return;
+
+	cht_get_stats(&cs);
+	for(i = CHT_STAGE_PROBE; i < CHT_STAGES; i++)
+		fprintf(stderr, "%-10s %-11s %lu files %.1f MB read %lu cached "
+				"%lu dropped %.1f MB saved\n", "", cht_stage_name(i), cs.files[i],
+				cs.bytes_read[i] / 1e6, cs.cached[i], cs.dropped[i],
+				cs.bytes_saved[i] / 1e6);
+}
+
+
+static void stats_compare(struct params *p)
+{
+	struct ct_stats cs;
+
+	if(!p->stats)
+		return;
+
+	ct_get_stats(&cs);
+	fprintf(stderr, "%-10s %lu classes %lu splits %.1f MB read "
+			"%lu pairs matched by extents\n", "",
+			cs.classes, cs.splits, cs.bytes_read / 1e6, cs.extent_matches);
+}
+
+
+//Space is reported even without stats, as it is the outcome of dedupe
+static void stats_dedupe(struct params *p)
+{
+	struct ct_stats cs;
+
+	if(!p->dedupe)
+		return;
+
+	ct_get_stats(&cs);
+	fprintf(stderr, "%lu files deduplicated, %lu names hard linked, "
+			"%lu bytes reclaimed\n", cs.deduped, cs.linked, cs.bytes_reclaimed);
+}
+
+
+//Keep index of duplicates live and answer queries until interrupted
+static int watch(struct params *p, struct thread_pool *tp, int dtt_flags)
+{
+	struct phase_stats st;
+	struct wt_stats ws;
+	struct map *m;
+	int status;
+
+	if(wt_open() != 0){
+		fprintf(stderr, "Could not set up watches\n");
+		return -EINVAL;
+	}
+
+	m = map_create();
+	if(m == NULL){
+		fprintf(stderr, "Could not create map\n");
+		return -ENOMEM;
+	}
+
+	//Traverse directory, watching every directory read
+	dtt_flags |= DTT_WATCH;
+	stats_start(p, &st);
+	if(dtt_start(p->scan_path, tp, m, NULL, dtt_flags) != 0){
+		fprintf(stderr, "Could not traverse directory\n");
+		return -EINVAL;
+	}
+	tp_wait_idle(tp);
+	stats_traverse(p, stats_end(p, &st, "traverse"));
+	dtt_finish();
+
+	//Move files into live index and split them into classes of equal files
+	stats_start(p, &st);
+	if(wt_merge(tp, m) != 0){
+		fprintf(stderr, "Could not build index\n");
+		return -ENOMEM;
+	}
+	stats_end(p, &st, "index");
+	if(p->stats){
+		wt_get_stats(&ws);
+		fprintf(stderr, "%-10s %lu files %lu classified\n", "", ws.files, ws.hashed);
+	}
+
+	status = wt_serve(tp, p->scan_path, dtt_flags, p->watch_path,
+						p->stats ? WT_STATS : 0);
+	if(status != 0)
+		fprintf(stderr, "Could not serve at %s: %s\n", p->watch_path, strerror(-status));
+
+	wt_close();
+	hc_close();
+	tp_destroy(tp);
+
+	return status;
+}
+
+
 int main(int argc, char *argv[])
 {
-	struct timespec ts = {0, 1000000};
+	struct phase_stats st;
+	struct map *m = NULL;
+	struct size_index *idx;
+	int dtt_flags;
 
 	//get program parameters
 	struct params p;
@@ -113,61 +392,126 @@ int main(int argc, char *argv[])
 		return -ENOMEM;
 	}
 
-	//Create empty map of potential matches by size
-	struct map *m = map_create();
-	if(m == NULL){
-		fprintf(stderr, "Could not create map\n");
-		return -ENOMEM;
+	//Load keys of previous runs
+	if(p.cache_path != NULL && hc_open(p.cache_path) != 0){
+		fprintf(stderr, "Could not open hash cache %s\n", p.cache_path);
+		return -EINVAL;
 	}
 
-	//Traverse directory
-	if(dtt_start(p.scan_path, tp, m, p.recursive) != 0){
-		fprintf(stderr, "Could not traverse directory\n");
+	//Load tree of previous run
+	if(p.snapshot_path != NULL && ss_open(p.snapshot_path) != 0){
+		fprintf(stderr, "Could not open snapshot %s\n", p.snapshot_path);
 		return -EINVAL;
 	}
 
-	//Wait for end of traversing
-	while(tp->num_enqueued_tasks != 0){
-		nanosleep(&ts, NULL);
-	}
+	dtt_flags = (p.recursive ? DTT_RECURSIVE : 0) | (p.uring ? DTT_URING : 0) |
+				(p.snapshot_path != NULL ? DTT_SNAPSHOT : 0);
 
-	//Calculate hashes of potential matches
-	if(cht_start(tp, m) != 0){
-		fprintf(stderr, "Could not calculate hashes\n");
-		return -EINVAL;
-	}
+	if(p.watch_path != NULL)
+		return watch(&p, tp, dtt_flags);
 
-	//Wait for end of hashing
-	while(tp->num_enqueued_tasks != 0){
-		nanosleep(&ts, NULL);
-	}
+	//Group files by size in per thread tables, merged after traversal
+	if(p.local_agg){
+		struct size_agg *sa = sa_create(tp);
+		if(sa == NULL){
+			fprintf(stderr, "Could not create size tables\n");
+			return -ENOMEM;
+		}
 
-	//Calculate hashes of potential matches
-	if(ct_start(tp, m) != 0){
-		fprintf(stderr, "Could not calculate hashes\n");
-		return -EINVAL;
-	}
+		//Traverse directory
+		stats_start(&p, &st);
+		if(dtt_start(p.scan_path, tp, NULL, sa, dtt_flags) != 0){
+			fprintf(stderr, "Could not traverse directory\n");
+			return -EINVAL;
+		}
+		tp_wait_idle(tp);
+		stats_traverse(&p, stats_end(&p, &st, "traverse"));
+		dtt_finish();
+
+		//Merge thread tables into a flat index sorted by size
+		stats_start(&p, &st);
+		idx = sa_freeze(sa);
+		sa_destroy(sa);
+		if(idx == NULL){
+			fprintf(stderr, "Could not build index\n");
+			return -ENOMEM;
+		}
+		stats_end(&p, &st, "merge");
+	} else {
+		//Create empty map of potential matches by size
+		m = map_create();
+		if(m == NULL){
+			fprintf(stderr, "Could not create map\n");
+			return -ENOMEM;
+		}
+
+		//Traverse directory. Potential matches are probed while traversal
+		//is still in progress, later stages and comparison wait for it
+		stats_start(&p, &st);
+		if(dtt_start(p.scan_path, tp, m, NULL, dtt_flags) != 0){
+			fprintf(stderr, "Could not traverse directory\n");
+			return -EINVAL;
+		}
 
-	//Wait for end of comparing
-	while(tp->num_enqueued_tasks != 0 ||
-			tp->num_waiting_threads != tp->num_threads){
-		nanosleep(&ts, NULL);
+		//Wait for end of traversing and probing
+		tp_wait_idle(tp);
+		stats_traverse(&p, stats_end(&p, &st, "traverse"));
+		dtt_finish();
+
+		//Compact potential matches into a flat index sorted by size
+		stats_start(&p, &st);
+		idx = si_freeze(tp, m);
+		if(idx == NULL){
+			fprintf(stderr, "Could not build index\n");
+			return -ENOMEM;
+		}
+		stats_end(&p, &st, "freeze");
 	}
 
-	//Free potential matches list
-	if(fmt_start(tp, m) != 0){
+	//Meanwhile free files of unique size, left in the map
+	if(m != NULL && fmt_start(tp, m) != 0){
 		fprintf(stderr, "Could not free data\n");
 		return -EINVAL;
 	}
 
-	//Wait for end of freeing
-	while(tp->num_enqueued_tasks != 0 ||
-			tp->num_waiting_threads != tp->num_threads){
-		nanosleep(&ts, NULL);
+	//Narrow down potential matches by keys of growing parts of files
+	stats_start(&p, &st);
+	if(cht_index_hash(tp, idx, p.extents ? CHT_EXTENTS : 0) != 0){
+		fprintf(stderr, "Could not calculate hashes\n");
+		return -EINVAL;
+	}
+	stats_end(&p, &st, "hash");
+	stats_hash(&p);
+
+	//Compare potential matches
+	stats_start(&p, &st);
+	if(ct_start(tp, idx, (p.snapshot_path != NULL ? CT_SNAPSHOT : 0) |
+						(p.dedupe ? CT_DEDUPE : 0)) != 0){
+		fprintf(stderr, "Could not compare files\n");
+		return -EINVAL;
 	}
 
-	//destroy map
-	map_destroy(m);
+	//Wait for end of comparing and freeing
+	tp_wait_idle(tp);
+	out_flush();
+	stats_end(&p, &st, "compare");
+	stats_compare(&p);
+	stats_dedupe(&p);
+
+	//Keep keys for the next run
+	if(p.cache_path != NULL && hc_save(idx) != 0)
+		fprintf(stderr, "Could not save hash cache %s\n", p.cache_path);
+	hc_close();
+
+	//Keep tree for the next run
+	if(p.snapshot_path != NULL && ss_save(p.diff_path) != 0)
+		fprintf(stderr, "Could not save snapshot %s\n", p.snapshot_path);
+	ss_close();
+
+	//destroy map and index
+	if(m != NULL)
+		map_destroy(m);
+	si_destroy(idx);
 
 	//destroy thread pool
 	tp_destroy(tp);
@@ -0,0 +1,126 @@
+/*
+ * Parallel iteration over all elements of a map
+ * No references this time
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "thread_pool.h"
+#include "lf_map.h"
+#include "list_utils.h"
+#include "obj_cache.h"
+#include "ebr.h"
+
+#include "map_iter_task.h"
+
+
+struct mit_arg {
+	struct tp_task task;
+	struct thread_pool *tp;
+	struct map *m;
+	void (*fn)(struct node *n, void *ctx);
+	void *ctx;
+
+	unsigned int depth;
+	unsigned int max_depth;
+	uint64_t idx;
+};
+
+
+static int mit_enqueue(struct mit_arg *arg, unsigned int depth, uint64_t idx);
+
+
+//Walk a single range of the map
+static void mit_walk(struct mit_arg *arg)
+{
+	struct map_range r;
+	struct node *tmp, *n;
+
+	if(map_get_range(arg->m, arg->depth, arg->idx, &r) != 0){
+		fprintf(stderr, "Error: Out of memory\n");
+		return;
+	}
+
+	//Elements removed by fn stay readable until we leave critical section
+	ebr_enter();
+	n = r.begin;
+	while(n != r.end){
+		tmp = n;
+		n = L_NEXT(n);
+
+		//skip bucket heads and null nodes
+		if(L_KEY(tmp) == LF_MAP_DUMMY_N_KEY || L_DATA(tmp) == NULL)
+			continue;
+
+		arg->fn(tmp, arg->ctx);
+	}
+	ebr_exit();
+
+	return;
+}
+
+
+void mit_worker(void *_arg)
+{
+	struct mit_arg *arg = _arg;
+
+	//Give away upper half of the range until it is small enough
+	while(arg->depth < arg->max_depth){
+		arg->depth++;
+		arg->idx *= 2;
+		if(mit_enqueue(arg, arg->depth, arg->idx + 1) != 0)
+			fprintf(stderr, "Error: Out of memory\n");
+	}
+
+	mit_walk(arg);
+
+	oc_free(arg);
+	return;
+}
+
+
+static int mit_enqueue(struct mit_arg *arg, unsigned int depth, uint64_t idx)
+{
+	int status;
+	struct mit_arg *n_arg = oc_alloc(sizeof(*n_arg));
+	if(n_arg == NULL)
+		return -ENOMEM;
+
+	*n_arg = *arg;
+	n_arg->depth = depth;
+	n_arg->idx = idx;
+	n_arg->task.task = mit_worker;
+	n_arg->task.arg = n_arg;
+	n_arg->task.pool_owned = 0;
+
+	if((status = tp_enqueue(arg->tp, &n_arg->task)) != 0)
+		oc_free(n_arg);
+
+	return status;
+}
+
+
+int mit_start(struct thread_pool *tp, struct map *m,
+				void (*fn)(struct node *n, void *ctx), void *ctx)
+{
+	struct mit_arg arg;
+	unsigned int ranges = tp->num_threads * MIT_RANGES_PER_THREAD;
+
+	arg.tp = tp;
+	arg.m = m;
+	arg.fn = fn;
+	arg.ctx = ctx;
+
+	//Split into enough ranges for all threads, but not finer than buckets
+	for(arg.max_depth = 0; (1U << arg.max_depth) < ranges; arg.max_depth++)
+		if((2U << arg.max_depth) > m->size)
+			break;
+
+	return mit_enqueue(&arg, 0, 0);
+}
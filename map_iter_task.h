@@ -0,0 +1,40 @@
+/*
+ * Parallel iteration over all elements of a map
+ * No references this time
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#ifndef __MAP_ITER_TASK_H
+#define __MAP_ITER_TASK_H
+
+#include "thread_pool.h"
+#include "lf_map.h"
+
+
+#define MIT_RANGES_PER_THREAD		8
+
+
+/*
+ * Call a function for every element of the map from all pool threads
+ *
+ * Map list is split recursively into disjoint ranges, each range is walked
+ * by a single task. Dummy bucket nodes and elements without data are skipped.
+ * Function may remove the element it was called for from the map.
+ *
+ * Arguments:
+ *		tp  - thread pool for task execution
+ *		m   - map to iterate
+ *		fn  - function to be called for each element
+ *		ctx - argument passed to fn together with element
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - on failure
+ */
+int mit_start(struct thread_pool *tp, struct map *m,
+				void (*fn)(struct node *n, void *ctx), void *ctx);
+
+
+#endif
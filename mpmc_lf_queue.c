@@ -13,6 +13,8 @@
 #include <errno.h>
 
 #include "mpmc_lf_queue.h"
+#include "obj_cache.h"
+#include "ebr.h"
 
 #define CAS(ptr, expected, desired) __atomic_compare_exchange(ptr, \
 														expected, \
@@ -25,13 +27,13 @@
 struct mpmcq *MPMCQ_create(void)
 {
 	//Allocate structures
-	struct mpmcq_elem *node = malloc(sizeof(*node));
+	struct mpmcq_elem *node = oc_alloc(sizeof(*node));
 	if(node == NULL)
 		return NULL;
 
 	struct mpmcq *q = malloc(sizeof(*q));
 	if(q == NULL){
-		free(node);
+		oc_free(node);
 		return NULL;
 	}
 
@@ -56,7 +58,7 @@ void MPMCQ_destroy(struct mpmcq *q)
 	while(MPMCQ_dequeue(q) != NULL);
 
 	//Free dummy element
-	free(q->head.ptr.ptr);
+	oc_free(q->head.ptr.ptr);
 
 	//Free queue struct
 	free(q);
@@ -73,8 +75,9 @@ int MPMCQ_enqueue(struct mpmcq *q, void *elem)
 	if(elem == NULL)
 		return -EINVAL;
 
-	//Allocate node
-	struct mpmcq_elem *node = malloc(sizeof(*node));
+	//Allocate node, recently released nodes are reused.
+	//Tagged pointers protect from ABA problem
+	struct mpmcq_elem *node = oc_alloc(sizeof(*node));
 	if(node == NULL)
 		return -ENOMEM;
 
@@ -84,6 +87,7 @@ int MPMCQ_enqueue(struct mpmcq *q, void *elem)
 
 	//Try to insert nodes until it has happened
 	union ptr_with_tag tail, next;
+	ebr_enter();
 	while(1){
 		tail = q->tail;
 		next = tail.ptr.ptr->next;
@@ -109,6 +113,7 @@ int MPMCQ_enqueue(struct mpmcq *q, void *elem)
 	tmp.ptr.ptr = node;
 	tmp.ptr.cnt = tail.ptr.cnt + 1;
 	CAS(&q->tail.blk, &tail.blk, &tmp.blk);
+	ebr_exit();
 	__atomic_add_fetch(&q->elem_cnt, 1, __ATOMIC_SEQ_CST);
 
 	return 0;
@@ -119,6 +124,7 @@ void *MPMCQ_dequeue(struct mpmcq *q)
 {
 	void *data = NULL;
 	union ptr_with_tag head, tail, next, tmp;
+	ebr_enter();
 	while(1){
 		head = q->head;
 		tail = q->tail;
@@ -131,8 +137,10 @@ void *MPMCQ_dequeue(struct mpmcq *q)
 		//Check for empty and new additions
 		//if ok remove element and return its data
 		if(head.ptr.ptr == tail.ptr.ptr){
-			if(next.ptr.ptr == NULL)
+			if(next.ptr.ptr == NULL){
+				ebr_exit();
 				return NULL;
+			}
 			tmp.ptr.ptr = next.ptr.ptr;
 			tmp.ptr.cnt = tail.ptr.cnt + 1;
 			CAS(&q->tail.blk, &tail.blk, &tmp.blk);
@@ -146,7 +154,9 @@ void *MPMCQ_dequeue(struct mpmcq *q)
 	}
 	__atomic_sub_fetch(&q->elem_cnt, 1, __ATOMIC_SEQ_CST);
 
-	free(head.ptr.ptr);
+	//Other threads may still be reading old dummy node
+	ebr_retire(head.ptr.ptr, oc_free);
+	ebr_exit();
 	return data;
 }
 
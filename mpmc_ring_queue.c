@@ -0,0 +1,149 @@
+/*
+ * Implementation of bounded Multiple Producer Multiple Consumer queue
+ * Reference: http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ *
+ * Author: Rytis Karpuška
+ *			rytis.karpuska@gmail.com
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "mpmc_ring_queue.h"
+
+#define LOAD(ptr, order)		__atomic_load_n(ptr, order)
+#define STORE(ptr, val, order)	__atomic_store_n(ptr, val, order)
+#define CAS(ptr, expected, desired) __atomic_compare_exchange_n(ptr, \
+														expected, \
+														desired, \
+														1, \
+														__ATOMIC_SEQ_CST, \
+														__ATOMIC_RELAXED)
+
+
+struct mpmcrq *MPMCRQ_create(unsigned long size)
+{
+	unsigned long i, real_size = 2;
+
+	//Round size up to a power of two
+	while(real_size < size)
+		real_size <<= 1;
+
+	//Allocate structures
+	struct mpmcrq *q;
+	if(posix_memalign((void **)&q, MPMCRQ_CACHE_LINE, sizeof(*q)) != 0)
+		return NULL;
+
+	if(posix_memalign((void **)&q->buf, MPMCRQ_CACHE_LINE,
+						sizeof(*q->buf) * real_size) != 0){
+		free(q);
+		return NULL;
+	}
+
+	//Each cell expects to be written with position equal to its index
+	for(i = 0; i < real_size; i++){
+		q->buf[i].seq = i;
+		q->buf[i].data = NULL;
+	}
+
+	q->mask = real_size - 1;
+	q->enq_pos = 0;
+	q->deq_pos = 0;
+
+	return q;
+}
+
+
+void MPMCRQ_destroy(struct mpmcrq *q)
+{
+	free(q->buf);
+	free(q);
+
+	return;
+}
+
+
+int MPMCRQ_enqueue(struct mpmcrq *q, void *elem)
+{
+	struct mpmcrq_cell *cell;
+	unsigned long pos, seq;
+	long diff;
+
+	//Check if elem is valid
+	if(elem == NULL)
+		return -EINVAL;
+
+	//Reserve a cell
+	pos = LOAD(&q->enq_pos, __ATOMIC_RELAXED);
+	while(1){
+		cell = &q->buf[pos & q->mask];
+		seq = LOAD(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)pos;
+
+		if(diff == 0){
+			if(CAS(&q->enq_pos, &pos, pos + 1))
+				break;
+		} else if(diff < 0){
+			//Cell from previous lap is not consumed yet
+			return -EAGAIN;
+		} else {
+			pos = LOAD(&q->enq_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	//Publish element
+	cell->data = elem;
+	STORE(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
+void *MPMCRQ_dequeue(struct mpmcrq *q)
+{
+	struct mpmcrq_cell *cell;
+	unsigned long pos, seq;
+	void *data;
+	long diff;
+
+	//Reserve a cell
+	pos = LOAD(&q->deq_pos, __ATOMIC_RELAXED);
+	while(1){
+		cell = &q->buf[pos & q->mask];
+		seq = LOAD(&cell->seq, __ATOMIC_ACQUIRE);
+		diff = (long)seq - (long)(pos + 1);
+
+		if(diff == 0){
+			if(CAS(&q->deq_pos, &pos, pos + 1))
+				break;
+		} else if(diff < 0){
+			//Cell is not written yet
+			return NULL;
+		} else {
+			pos = LOAD(&q->deq_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	//Take element and release cell for the next lap
+	data = cell->data;
+	STORE(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+
+	return data;
+}
+
+
+unsigned long MPMCRQ_count(struct mpmcrq *q)
+{
+	unsigned long deq = LOAD(&q->deq_pos, __ATOMIC_SEQ_CST);
+	unsigned long enq = LOAD(&q->enq_pos, __ATOMIC_SEQ_CST);
+
+	return enq > deq ? enq - deq : 0;
+}
+
+
+unsigned long MPMCRQ_size(struct mpmcrq *q)
+{
+	return q->mask + 1;
+}
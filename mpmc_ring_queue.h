@@ -0,0 +1,112 @@
+/*
+ * Implementation of bounded Multiple Producer Multiple Consumer queue
+ * Reference: http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ *
+ * Elements are stored in a preallocated ring buffer, thus queue does not
+ * allocate memory on enqueue and does not need double-word CAS.
+ * When queue is full enqueue fails and caller must apply backpressure.
+ *
+ * Author: Rytis Karpuška
+ *			rytis.karpuska@gmail.com
+ *
+ */
+
+#ifndef MPMC_RING_QUEUE_H
+#define MPMC_RING_QUEUE_H
+
+#include <stdint.h>
+
+#define MPMCRQ_CACHE_LINE		64
+
+struct mpmcrq_cell {
+	volatile unsigned long seq;
+	void *data;
+};
+
+struct mpmcrq {
+	volatile unsigned long enq_pos;
+	char pad0[MPMCRQ_CACHE_LINE - sizeof(unsigned long)];
+	volatile unsigned long deq_pos;
+	char pad1[MPMCRQ_CACHE_LINE - sizeof(unsigned long)];
+	unsigned long mask;
+	struct mpmcrq_cell *buf;
+};
+
+
+/*
+ * Create a new bounded MPMC queue
+ *
+ * Arguments:
+ * 		size - maximum number of elements, rounded up to a power of two
+ *
+ * Return:
+ * 		NULL                     - if error occured
+ * 		pointer to struct mpmcrq - on success
+ */
+struct mpmcrq *MPMCRQ_create(unsigned long size);
+
+
+/*
+ * Destroy a queue previously created with MPMCRQ_create
+ * NOTE: This function does not free data stored in queue
+ * NOTE: This function does not support concurrency
+ *
+ * Arguments:
+ * 		q - pointer to queue previously created with MPMCRQ_create
+ */
+void MPMCRQ_destroy(struct mpmcrq *q);
+
+
+/*
+ * Enqeue an element into queue previously created with MPMCRQ_create
+ *
+ * Arguments:
+ * 		q    - queue previously created by MPMCRQ_create
+ * 		elem - pointer to data
+ *
+ * Return:
+ * 		0                   - on success
+ * 		-EAGAIN             - if queue is full
+ * 		negative error code - on other failures
+ */
+int MPMCRQ_enqueue(struct mpmcrq *q, void *elem);
+
+
+/*
+ * Dequeue an element from queue previously created with MPMCRQ_create
+ *
+ * Arguments:
+ * 		q    - queue previously created by MPMCRQ_create
+ *
+ * Return:
+ * 		NULL            - if queue is empty
+ * 		pointer to data - on success
+ */
+void *MPMCRQ_dequeue(struct mpmcrq *q);
+
+
+/*
+ * Get number of elements in the queue. Result is only a hint under concurrency
+ *
+ * Arguments:
+ * 		q    - queue previously created by MPMCRQ_create
+ *
+ * Return:
+ * 		number of elements in the queue
+ */
+unsigned long MPMCRQ_count(struct mpmcrq *q);
+
+
+/*
+ * Get maximum number of elements queue can hold
+ *
+ * Arguments:
+ * 		q    - queue previously created by MPMCRQ_create
+ *
+ * Return:
+ * 		queue capacity
+ */
+unsigned long MPMCRQ_size(struct mpmcrq *q);
+
+
+#endif
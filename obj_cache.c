@@ -0,0 +1,169 @@
+/*
+ * Per thread cache of recycled memory blocks
+ * No references this time
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "obj_cache.h"
+
+#define OC_CLASS_CNT			(OC_MAX_SHIFT - OC_MIN_SHIFT + 1)
+#define OC_NO_CLASS				-1
+
+//Header placed in front of every block
+struct oc_hdr {
+	long cls;
+	struct oc_hdr *next;
+};
+
+struct oc_cache {
+	struct oc_hdr *head[OC_CLASS_CNT];
+	int cnt[OC_CLASS_CNT];
+	void *scratch[OC_SCRATCH_SLOTS];
+	size_t scratch_size[OC_SCRATCH_SLOTS];
+	int registered;
+};
+
+static __thread struct oc_cache oc_cache;
+
+static pthread_key_t oc_key;
+static pthread_once_t oc_key_once = PTHREAD_ONCE_INIT;
+
+
+//Release all cached blocks of exiting thread
+static void oc_cache_release(void *arg)
+{
+	struct oc_cache *c = arg;
+	struct oc_hdr *tmp;
+	int i;
+
+	for(i = 0; i < OC_CLASS_CNT; i++){
+		while(c->head[i] != NULL){
+			tmp = c->head[i];
+			c->head[i] = tmp->next;
+			free(tmp);
+		}
+		c->cnt[i] = 0;
+	}
+
+	for(i = 0; i < OC_SCRATCH_SLOTS; i++){
+		free(c->scratch[i]);
+		c->scratch[i] = NULL;
+		c->scratch_size[i] = 0;
+	}
+
+	return;
+}
+
+
+static void oc_key_create(void)
+{
+	pthread_key_create(&oc_key, oc_cache_release);
+}
+
+
+//Make sure cache is released on thread exit
+static void oc_register(void)
+{
+	if(oc_cache.registered)
+		return;
+
+	pthread_once(&oc_key_once, oc_key_create);
+	pthread_setspecific(oc_key, &oc_cache);
+	oc_cache.registered = 1;
+}
+
+
+//Find smallest class fitting size bytes together with header
+static long oc_class(size_t size)
+{
+	long cls;
+
+	size += sizeof(struct oc_hdr);
+	for(cls = 0; cls < OC_CLASS_CNT; cls++)
+		if(size <= (1UL << (cls + OC_MIN_SHIFT)))
+			return cls;
+
+	return OC_NO_CLASS;
+}
+
+
+void *oc_alloc(size_t size)
+{
+	struct oc_hdr *h;
+	long cls = oc_class(size);
+
+	//Too big for caching
+	if(cls == OC_NO_CLASS){
+		h = malloc(sizeof(*h) + size);
+		if(h == NULL)
+			return NULL;
+		h->cls = OC_NO_CLASS;
+		return h + 1;
+	}
+
+	//Take block from cache if there is one
+	if((h = oc_cache.head[cls]) != NULL){
+		oc_cache.head[cls] = h->next;
+		oc_cache.cnt[cls]--;
+		return h + 1;
+	}
+
+	h = malloc(1UL << (cls + OC_MIN_SHIFT));
+	if(h == NULL)
+		return NULL;
+	h->cls = cls;
+
+	return h + 1;
+}
+
+
+void oc_free(void *p)
+{
+	struct oc_hdr *h;
+
+	if(p == NULL)
+		return;
+
+	h = (struct oc_hdr *)p - 1;
+
+	//Release uncached and excess blocks
+	if(h->cls == OC_NO_CLASS || oc_cache.cnt[h->cls] >= OC_MAX_CACHED){
+		free(h);
+		return;
+	}
+
+	oc_register();
+
+	h->next = oc_cache.head[h->cls];
+	oc_cache.head[h->cls] = h;
+	oc_cache.cnt[h->cls]++;
+
+	return;
+}
+
+
+void *oc_scratch(unsigned int slot, size_t size)
+{
+	void *p;
+
+	if(slot >= OC_SCRATCH_SLOTS)
+		return NULL;
+
+	if(oc_cache.scratch_size[slot] >= size)
+		return oc_cache.scratch[slot];
+
+	//Grow buffer
+	if((p = realloc(oc_cache.scratch[slot], size)) == NULL)
+		return NULL;
+
+	oc_register();
+	oc_cache.scratch[slot] = p;
+	oc_cache.scratch_size[slot] = size;
+
+	return p;
+}
@@ -0,0 +1,70 @@
+/*
+ * Per thread cache of recycled memory blocks
+ * No references this time
+ *
+ * Blocks are grouped into power of two size classes. Released blocks are
+ * kept in a cache of the releasing thread and handed out again by the
+ * following allocations of that thread, so that steady state task
+ * submission does not go to the allocator.
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#ifndef __OBJ_CACHE_H
+#define __OBJ_CACHE_H
+
+#include <stddef.h>
+
+#define OC_MIN_SHIFT			5		//32B
+#define OC_MAX_SHIFT			13		//8KB
+#define OC_MAX_CACHED			1024	//Max blocks cached per class per thread
+#define OC_SCRATCH_SLOTS		4
+
+//Scratch buffer slots
+#define OC_SCRATCH_HASH			0
+#define OC_SCRATCH_CMP1			1
+#define OC_SCRATCH_CMP2			2
+#define OC_SCRATCH_DENTS		3
+
+
+/*
+ * Allocate a memory block. Blocks larger than biggest size class are
+ * allocated with malloc directly
+ *
+ * Arguments:
+ *		size - size of a block in bytes
+ *
+ * Return:
+ *		NULL              - if out of memory
+ *		pointer to memory - on success
+ */
+void *oc_alloc(size_t size);
+
+
+/*
+ * Release a memory block previously allocated by oc_alloc
+ * Block may be released by a different thread than it was allocated by
+ *
+ * Arguments:
+ *		p - pointer previously returned by oc_alloc or NULL
+ */
+void oc_free(void *p);
+
+
+/*
+ * Get per thread scratch buffer. Buffer is kept between calls and
+ * released when thread exits, so it must not be used across tasks
+ *
+ * Arguments:
+ *		slot - scratch buffer number, less than OC_SCRATCH_SLOTS
+ *		size - minimal size of a buffer in bytes
+ *
+ * Return:
+ *		NULL              - if out of memory
+ *		pointer to memory - on success
+ */
+void *oc_scratch(unsigned int slot, size_t size);
+
+
+#endif
@@ -0,0 +1,394 @@
+/*
+ * Output of found duplicates
+ * Reference: https://jsonlines.org
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "output.h"
+
+struct out_buf {
+	char *data;
+	size_t len;
+	size_t cap;
+	struct out_buf *next;
+};
+
+static const char *out_names[] = {
+	[OUT_PAIRS] = "pairs",
+	[OUT_TEXT] = "text",
+	[OUT_NUL] = "nul",
+	[OUT_JSON] = "json",
+};
+
+static int out_fmt = OUT_PAIRS;
+static int out_fd = STDOUT_FILENO;
+
+//Buffer of calling thread and list of buffers of all threads
+static __thread struct out_buf *out_local;
+static struct out_buf *out_bufs;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t out_key;
+static pthread_once_t out_key_once = PTHREAD_ONCE_INIT;
+
+
+//Write out whole buffer. Writes are serialized, so that records never interleave
+static void out_write(struct out_buf *b)
+{
+	size_t off = 0;
+	ssize_t ret;
+
+	pthread_mutex_lock(&out_lock);
+	while(off < b->len){
+		ret = write(out_fd, b->data + off, b->len - off);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0){
+			fprintf(stderr, "Error: output: %s\n", strerror(errno));
+			break;
+		}
+		off += ret;
+	}
+	pthread_mutex_unlock(&out_lock);
+
+	b->len = 0;
+
+	return;
+}
+
+
+//Flush and release buffer of exiting thread
+static void out_buf_release(void *arg)
+{
+	struct out_buf *b = arg, **pp;
+
+	if(b->len != 0)
+		out_write(b);
+
+	pthread_mutex_lock(&out_lock);
+	for(pp = &out_bufs; *pp != NULL; pp = &(*pp)->next){
+		if(*pp == b){
+			*pp = b->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&out_lock);
+
+	free(b->data);
+	free(b);
+
+	return;
+}
+
+
+static void out_key_create(void)
+{
+	pthread_key_create(&out_key, out_buf_release);
+}
+
+
+//Get buffer of calling thread, creating it on first use
+static struct out_buf *out_get_buf(void)
+{
+	struct out_buf *b = out_local;
+	if(b != NULL)
+		return b;
+
+	b = calloc(1, sizeof(*b));
+	if(b == NULL)
+		return NULL;
+
+	b->data = malloc(OUT_BUF_SIZE);
+	if(b->data == NULL){
+		free(b);
+		return NULL;
+	}
+	b->cap = OUT_BUF_SIZE;
+
+	pthread_once(&out_key_once, out_key_create);
+	pthread_setspecific(out_key, b);
+
+	pthread_mutex_lock(&out_lock);
+	b->next = out_bufs;
+	out_bufs = b;
+	pthread_mutex_unlock(&out_lock);
+
+	out_local = b;
+
+	return b;
+}
+
+
+//Make room for n more bytes, a record is always kept whole in a buffer
+static int out_reserve(struct out_buf *b, size_t n)
+{
+	size_t cap = b->cap;
+	char *data;
+
+	if(b->len + n <= cap)
+		return 0;
+
+	while(b->len + n > cap)
+		cap *= 2;
+
+	data = realloc(b->data, cap);
+	if(data == NULL)
+		return -ENOMEM;
+
+	b->data = data;
+	b->cap = cap;
+
+	return 0;
+}
+
+
+static void out_append(struct out_buf *b, const void *p, size_t n)
+{
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+
+	return;
+}
+
+
+//Write buffer out once it holds enough of complete records
+static void out_commit(struct out_buf *b)
+{
+	if(b->len >= OUT_BUF_SIZE)
+		out_write(b);
+
+	return;
+}
+
+
+int out_set_format(const char *name)
+{
+	int i;
+
+	for(i = 0; i < sizeof(out_names) / sizeof(out_names[0]); i++){
+		if(strcmp(name, out_names[i]) == 0){
+			out_fmt = i;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+
+int out_format(void)
+{
+	return out_fmt;
+}
+
+
+void out_set_fd(int fd)
+{
+	out_flush();
+	out_fd = fd;
+
+	return;
+}
+
+
+void out_pair(const char *f1, const char *f2)
+{
+	size_t l1 = strlen(f1), l2 = strlen(f2);
+	struct out_buf *b = out_get_buf();
+
+	if(b == NULL || out_reserve(b, l1 + l2 + 2) != 0){
+		fprintf(stderr, "Error: %s\n", strerror(ENOMEM));
+		return;
+	}
+
+	out_append(b, f1, l1);
+	out_append(b, " ", 1);
+	out_append(b, f2, l2);
+	out_append(b, "\n", 1);
+	out_commit(b);
+
+	return;
+}
+
+
+//Get length of a valid UTF-8 sequence at the start of a string, or 0 if it
+//is not valid. Overlong forms, surrogates and code points past U+10FFFF are
+//not valid
+static int out_utf8_len(const unsigned char *s)
+{
+	uint32_t cp;
+	int len, i;
+
+	if(s[0] < 0x80)
+		return 1;
+	else if((s[0] & 0xe0) == 0xc0)
+		len = 2, cp = s[0] & 0x1f;
+	else if((s[0] & 0xf0) == 0xe0)
+		len = 3, cp = s[0] & 0x0f;
+	else if((s[0] & 0xf8) == 0xf0)
+		len = 4, cp = s[0] & 0x07;
+	else
+		return 0;
+
+	//Terminating NUL is not a continuation byte, so it stops the loop
+	for(i = 1; i < len; i++){
+		if((s[i] & 0xc0) != 0x80)
+			return 0;
+		cp = (cp << 6) | (s[i] & 0x3f);
+	}
+
+	if((len == 2 && cp < 0x80) || (len == 3 && cp < 0x800) ||
+			(len == 4 && cp < 0x10000) || cp > 0x10ffff ||
+			(cp >= 0xd800 && cp <= 0xdfff))
+		return 0;
+
+	return len;
+}
+
+
+static int out_utf8_valid(const char *s)
+{
+	int len;
+
+	for(; *s != '\0'; s += len)
+		if((len = out_utf8_len((const unsigned char *)s)) == 0)
+			return 0;
+
+	return 1;
+}
+
+
+//Append a file name as JSON string. Bytes which are not valid in UTF-8 are
+//replaced by U+FFFD, names which have them are given in bytes as well
+static void out_json_string(struct out_buf *b, const char *s)
+{
+	int len;
+
+	out_append(b, "\"", 1);
+	while(*s != '\0'){
+		if(*s == '"' || *s == '\\'){
+			b->data[b->len++] = '\\';
+			b->data[b->len++] = *s++;
+		} else if((unsigned char)*s < 0x20){
+			b->len += sprintf(b->data + b->len, "\\u%04x", (unsigned char)*s++);
+		} else if((len = out_utf8_len((const unsigned char *)s)) == 0){
+			out_append(b, "\\ufffd", 6);
+			s++;
+		} else {
+			out_append(b, s, len);
+			s += len;
+		}
+	}
+	out_append(b, "\"", 1);
+
+	return;
+}
+
+
+//Append a file name as JSON array of its bytes
+static void out_json_bytes(struct out_buf *b, const char *s)
+{
+	out_append(b, "[", 1);
+	for(; *s != '\0'; s++)
+		b->len += sprintf(b->data + b->len, s[1] != '\0' ? "%u," : "%u",
+							(unsigned char)*s);
+	out_append(b, "]", 1);
+
+	return;
+}
+
+
+void out_set(uint64_t size, uint64_t wasted, const char **names, uint32_t cnt)
+{
+	struct out_buf *b = out_get_buf();
+	size_t need = OUT_HDR_SIZE;
+	uint32_t i, raw = 0;
+
+	//Every byte of a name takes at most 6 bytes when escaped and 4 more in
+	//an array of bytes
+	for(i = 0; i < cnt; i++){
+		need += strlen(names[i]) * (out_fmt == OUT_JSON ? 10 : 1) + 8;
+		if(out_fmt == OUT_JSON && !out_utf8_valid(names[i]))
+			raw++;
+	}
+
+	if(b == NULL || out_reserve(b, need) != 0){
+		fprintf(stderr, "Error: %s\n", strerror(ENOMEM));
+		return;
+	}
+
+	switch(out_fmt){
+	case OUT_TEXT:
+		b->len += sprintf(b->data + b->len, "# %u files, %" PRIu64
+							" bytes each, %" PRIu64 " bytes wasted\n",
+							cnt, size, wasted);
+		for(i = 0; i < cnt; i++){
+			out_append(b, names[i], strlen(names[i]));
+			out_append(b, "\n", 1);
+		}
+		out_append(b, "\n", 1);
+		break;
+
+	case OUT_NUL:
+		b->len += sprintf(b->data + b->len, "%" PRIu64 " %" PRIu64, size, wasted);
+		out_append(b, "", 1);
+		for(i = 0; i < cnt; i++)
+			out_append(b, names[i], strlen(names[i]) + 1);
+		out_append(b, "", 1);
+		break;
+
+	case OUT_JSON:
+		b->len += sprintf(b->data + b->len, "{\"size\":%" PRIu64 ",\"count\":%u,"
+							"\"wasted\":%" PRIu64 ",\"files\":[",
+							size, cnt, wasted);
+		for(i = 0; i < cnt; i++){
+			if(i != 0)
+				out_append(b, ",", 1);
+			out_json_string(b, names[i]);
+		}
+		out_append(b, "]", 1);
+
+		//Names which are not text are given in bytes, in the same order
+		if(raw != 0){
+			out_append(b, ",\"files_raw\":[", 14);
+			for(i = 0; i < cnt; i++){
+				if(i != 0)
+					out_append(b, ",", 1);
+				if(out_utf8_valid(names[i]))
+					out_append(b, "null", 4);
+				else
+					out_json_bytes(b, names[i]);
+			}
+			out_append(b, "]", 1);
+		}
+		out_append(b, "}\n", 2);
+		break;
+	}
+
+	out_commit(b);
+
+	return;
+}
+
+
+void out_flush(void)
+{
+	struct out_buf *b;
+
+	for(b = out_bufs; b != NULL; b = b->next)
+		if(b->len != 0)
+			out_write(b);
+
+	return;
+}
@@ -0,0 +1,106 @@
+/*
+ * Output of found duplicates
+ * Reference: https://jsonlines.org
+ *
+ * Duplicates are printed either as pairs, one "a b" line per pair of equal
+ * files, or as sets, one record per set of equal files. Sets are printed
+ * in one of three variants:
+ *		text - "#" header line with file count, size and wasted bytes,
+ *		       followed by a line per file and an empty line
+ *		nul  - "<size> <wasted>" header followed by file names, every field
+ *		       terminated with NUL and record terminated with an empty field
+ *		json - one JSON object per line with size, count, wasted and files,
+ *		       names which are not valid UTF-8 are given in files with
+ *		       U+FFFD in place of invalid bytes and, at the same position,
+ *		       as arrays of bytes in files_raw. Other files_raw items are null
+ *
+ * Every thread formats records into a buffer of its own, which is written
+ * out with a single write() call once it holds OUT_BUF_SIZE bytes. Records
+ * are never split between writes and writes are serialized, so records of
+ * different threads never interleave.
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#ifndef __OUTPUT_H
+#define __OUTPUT_H
+
+#include <stdint.h>
+
+//Output formats
+#define OUT_PAIRS				0
+#define OUT_TEXT				1
+#define OUT_NUL					2
+#define OUT_JSON				3
+
+#define OUT_BUF_SIZE			262144	//256KB, written out at once
+#define OUT_HDR_SIZE			128		//Enough for any record header
+
+
+/*
+ * Select output format
+ *
+ * Arguments:
+ *		name - one of "pairs", "text", "nul", "json"
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - if format is not known
+ */
+int out_set_format(const char *name);
+
+
+/*
+ * Get selected output format
+ *
+ * Return:
+ *		one of OUT_*
+ */
+int out_format(void);
+
+
+/*
+ * Select descriptor output is written to, STDOUT_FILENO by default
+ *
+ * Whatever is buffered so far is written out to the previous descriptor.
+ * Must not be called while other threads are printing.
+ *
+ * Arguments:
+ *		fd - descriptor to write to
+ */
+void out_set_fd(int fd);
+
+
+/*
+ * Print a pair of equal files, used with OUT_PAIRS format
+ *
+ * Arguments:
+ *		f1 - name of first file
+ *		f2 - name of second file
+ */
+void out_pair(const char *f1, const char *f2);
+
+
+/*
+ * Print a set of equal files, used with all formats but OUT_PAIRS
+ *
+ * Arguments:
+ *		size   - size of every file
+ *		wasted - bytes which could be reclaimed by keeping a single copy
+ *		names  - names of files
+ *		cnt    - number of files, at least 2
+ */
+void out_set(uint64_t size, uint64_t wasted, const char **names, uint32_t cnt);
+
+
+/*
+ * Write out buffers of all threads
+ *
+ * Must be called once nothing is printed anymore, before exiting.
+ * Buffers are released when their threads exit.
+ */
+void out_flush(void);
+
+
+#endif
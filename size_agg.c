@@ -0,0 +1,345 @@
+/*
+ * Thread local aggregation of files by size
+ * No references this time
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "thread_pool.h"
+#include "size_index.h"
+#include "file_desc.h"
+#include "obj_cache.h"
+
+#include "size_agg.h"
+
+#define SA_PART(h)				((h) >> (64 - SA_PART_BITS))
+#define SA_GROUP_NEEDED(e)		((e)->cnt > 1 || \
+									((e)->cnt == 1 && (e)->head->aliases != NULL))
+
+struct sa_merge_ctx {
+	struct size_agg *sa;
+	struct si_pending *pending[SA_PARTS];
+	unsigned long pending_cnt[SA_PARTS];
+	volatile int error;
+};
+
+struct sa_merge_arg {
+	struct tp_task task;
+	struct sa_merge_ctx *ctx;
+	int part;
+};
+
+
+//Mix bits of a size, so that both partition and slot bits are well spread
+static uint64_t sa_hash(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+
+	return k;
+}
+
+
+static struct sa_entry *sa_table_slot(struct sa_table *t, uint64_t size)
+{
+	unsigned long i = sa_hash(size) & t->mask;
+
+	while(t->e[i].cnt != 0 && t->e[i].size != size)
+		i = (i + 1) & t->mask;
+
+	return &t->e[i];
+}
+
+
+//Double table capacity, keeping it at most half full
+static int sa_table_grow(struct sa_table *t)
+{
+	struct sa_table n;
+	unsigned long i;
+
+	n.mask = t->e == NULL ? SA_INIT_SIZE - 1 : t->mask * 2 + 1;
+	n.used = t->used;
+	n.e = calloc(n.mask + 1, sizeof(*n.e));
+	if(n.e == NULL)
+		return -ENOMEM;
+
+	if(t->e != NULL){
+		for(i = 0; i <= t->mask; i++)
+			if(t->e[i].cnt != 0)
+				*sa_table_slot(&n, t->e[i].size) = t->e[i];
+		free(t->e);
+	}
+
+	*t = n;
+
+	return 0;
+}
+
+
+//Append a list of files of the same size into a table
+static int sa_table_put(struct sa_table *t, uint64_t size, uint32_t cnt,
+						struct file_desc *head, struct file_desc *tail)
+{
+	struct sa_entry *e;
+
+	if(t->e == NULL || (t->used + 1) * 2 > t->mask + 1)
+		if(sa_table_grow(t) != 0)
+			return -ENOMEM;
+
+	e = sa_table_slot(t, size);
+	if(e->cnt == 0){
+		e->size = size;
+		e->cnt = cnt;
+		e->head = head;
+		e->tail = tail;
+		t->used++;
+		return 0;
+	}
+
+	e->tail->next = head;
+	e->tail = tail;
+	e->cnt += cnt;
+
+	return 0;
+}
+
+
+static void sa_free_files(struct file_desc *fd)
+{
+	struct file_desc *tmp;
+
+	while(fd != NULL){
+		tmp = fd;
+		fd = fd->next;
+		fd_free(tmp);
+	}
+
+	return;
+}
+
+
+static void sa_table_free(struct sa_table *t)
+{
+	unsigned long i;
+
+	if(t->e == NULL)
+		return;
+
+	for(i = 0; i <= t->mask; i++)
+		if(t->e[i].cnt != 0)
+			sa_free_files(t->e[i].head);
+
+	free(t->e);
+	memset(t, 0, sizeof(*t));
+
+	return;
+}
+
+
+struct size_agg *sa_create(struct thread_pool *tp)
+{
+	struct size_agg *sa = calloc(1, sizeof(*sa));
+	if(sa == NULL)
+		return NULL;
+
+	sa->tp = tp;
+	sa->num_tables = tp->num_threads;
+	if(posix_memalign((void **)&sa->local, SA_CACHE_LINE,
+						sizeof(*sa->local) * sa->num_tables) != 0){
+		free(sa);
+		return NULL;
+	}
+	memset(sa->local, 0, sizeof(*sa->local) * sa->num_tables);
+
+	return sa;
+}
+
+
+int sa_add(struct size_agg *sa, struct file_desc *fd)
+{
+	int id = tp_worker_id(sa->tp);
+	if(id < 0)
+		return -EINVAL;
+
+	fd->next = NULL;
+
+	return sa_table_put(&sa->local[id].part[SA_PART(sa_hash(fd->size))],
+						fd->size, 1, fd, fd);
+}
+
+
+//Merge one partition of all thread tables and collect groups out of it
+void sa_merge_worker(void *_arg)
+{
+	struct sa_merge_arg *arg = _arg;
+	struct sa_merge_ctx *ctx = arg->ctx;
+	struct size_agg *sa = ctx->sa;
+	struct sa_table m, *t;
+	struct sa_entry *e;
+	struct si_pending *p;
+	struct file_desc *fd;
+	unsigned long i, cnt = 0;
+	int j;
+
+	//Merge tables of all threads
+	memset(&m, 0, sizeof(m));
+	for(j = 0; j < sa->num_tables; j++){
+		t = &sa->local[j].part[arg->part];
+		if(t->e == NULL)
+			continue;
+
+		for(i = 0; i <= t->mask; i++){
+			e = &t->e[i];
+			if(e->cnt == 0)
+				continue;
+
+			if(sa_table_put(&m, e->size, e->cnt, e->head, e->tail) != 0){
+				fprintf(stderr, "Error: Out of memory\n");
+				ctx->error = 1;
+				sa_free_files(e->head);
+			}
+		}
+
+		free(t->e);
+		memset(t, 0, sizeof(*t));
+	}
+
+	if(m.e == NULL)
+		goto DONE;
+
+	//Collect groups of potential matches
+	for(i = 0; i <= m.mask; i++)
+		if(SA_GROUP_NEEDED(&m.e[i]))
+			cnt++;
+
+	ctx->pending[arg->part] = malloc(sizeof(*p) * (cnt + 1));
+	if(ctx->pending[arg->part] == NULL){
+		fprintf(stderr, "Error: Out of memory\n");
+		ctx->error = 1;
+		sa_table_free(&m);
+		goto DONE;
+	}
+
+	for(i = 0, p = ctx->pending[arg->part]; i <= m.mask; i++){
+		e = &m.e[i];
+		if(e->cnt == 0)
+			continue;
+
+		//Files of unique size can never be duplicates, unless hard linked
+		if(!SA_GROUP_NEEDED(e)){
+			free(e->head);
+			continue;
+		}
+
+		p->size = e->size;
+		p->cnt = e->cnt;
+		p->q = NULL;
+		p->list = e->head;
+		p->arena_size = 0;
+		for(fd = e->head; fd != NULL; fd = fd->next)
+			p->arena_size += SI_RECORD_SIZE(fd);
+		p++;
+	}
+	ctx->pending_cnt[arg->part] = cnt;
+	free(m.e);
+
+DONE:
+	oc_free(arg);
+	return;
+}
+
+
+struct size_index *sa_freeze(struct size_agg *sa)
+{
+	struct sa_merge_ctx ctx;
+	struct sa_merge_arg *arg;
+	struct si_pending *pending = NULL;
+	struct size_index *idx = NULL;
+	unsigned long group_cnt = 0, i;
+	int part;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.sa = sa;
+
+	//Merge all partitions in parallel
+	for(part = 0; part < SA_PARTS; part++){
+		arg = oc_alloc(sizeof(*arg));
+		if(arg == NULL){
+			ctx.error = 1;
+			break;
+		}
+
+		arg->ctx = &ctx;
+		arg->part = part;
+		arg->task.task = sa_merge_worker;
+		arg->task.arg = arg;
+		arg->task.pool_owned = 0;
+		if(tp_enqueue(sa->tp, &arg->task) != 0){
+			oc_free(arg);
+			ctx.error = 1;
+			break;
+		}
+	}
+	tp_wait_idle(sa->tp);
+
+	if(ctx.error)
+		goto CLEANUP;
+
+	//Gather groups of all partitions
+	for(part = 0; part < SA_PARTS; part++)
+		group_cnt += ctx.pending_cnt[part];
+
+	pending = malloc(sizeof(*pending) * (group_cnt + 1));
+	if(pending == NULL)
+		goto CLEANUP;
+
+	for(part = 0, i = 0; part < SA_PARTS; part++){
+		if(ctx.pending_cnt[part] == 0)
+			continue;
+		memcpy(&pending[i], ctx.pending[part],
+				sizeof(*pending) * ctx.pending_cnt[part]);
+		i += ctx.pending_cnt[part];
+	}
+
+	idx = si_build(sa->tp, pending, group_cnt);
+	free(pending);
+
+	for(part = 0; part < SA_PARTS; part++)
+		free(ctx.pending[part]);
+
+	return idx;
+
+CLEANUP:
+	for(part = 0; part < SA_PARTS; part++){
+		for(i = 0; i < ctx.pending_cnt[part]; i++)
+			sa_free_files(ctx.pending[part][i].list);
+		free(ctx.pending[part]);
+	}
+
+	return NULL;
+}
+
+
+void sa_destroy(struct size_agg *sa)
+{
+	int i, part;
+
+	for(i = 0; i < sa->num_tables; i++)
+		for(part = 0; part < SA_PARTS; part++)
+			sa_table_free(&sa->local[i].part[part]);
+
+	free(sa->local);
+	free(sa);
+
+	return;
+}
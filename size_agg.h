@@ -0,0 +1,109 @@
+/*
+ * Thread local aggregation of files by size
+ * No references this time
+ *
+ * Each pool thread collects files into its own hash tables keyed by size,
+ * so traversal threads never contend on shared buckets. Tables are split
+ * into SA_PARTS partitions by size hash, which allows partitions to be
+ * merged in parallel once traversal is done.
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#ifndef __SIZE_AGG_H
+#define __SIZE_AGG_H
+
+#include <stdint.h>
+
+#include "thread_pool.h"
+#include "size_index.h"
+#include "file_desc.h"
+
+
+#define SA_PART_BITS			6
+#define SA_PARTS				(1 << SA_PART_BITS)
+#define SA_INIT_SIZE			16		//Initial entries of a partition table
+#define SA_CACHE_LINE			64
+
+//Files of the same size, linked through file_desc next field
+struct sa_entry {
+	uint64_t size;
+	uint32_t cnt;
+	struct file_desc *head;
+	struct file_desc *tail;
+};
+
+//Open addressing hash table, empty entries have cnt equal to zero
+struct sa_table {
+	unsigned long mask;
+	unsigned long used;
+	struct sa_entry *e;
+};
+
+struct sa_local {
+	struct sa_table part[SA_PARTS];
+} __attribute__((aligned(SA_CACHE_LINE)));
+
+struct size_agg {
+	struct thread_pool *tp;
+	int num_tables;
+	struct sa_local *local;
+};
+
+
+/*
+ * Create an empty aggregation with a table set for each thread of a pool
+ *
+ * Arguments:
+ *		tp - thread pool which threads will be adding files
+ *
+ * Return:
+ *		NULL                      - on failure
+ *		pointer to struct size_agg - on success
+ */
+struct size_agg *sa_create(struct thread_pool *tp);
+
+
+/*
+ * Add file into calling thread's tables
+ *
+ * Arguments:
+ *		sa - aggregation previously returned by sa_create
+ *		fd - file to add, size must be filled in
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - on failure
+ */
+int sa_add(struct size_agg *sa, struct file_desc *fd);
+
+
+/*
+ * Merge tables of all threads and build a frozen index out of them
+ *
+ * Partitions are merged in parallel. Files of unique size are released,
+ * all other files are moved into index. Afterwards aggregation is empty.
+ * Caller must make sure no files are being added and this function must
+ * not be called from a pool thread.
+ *
+ * Arguments:
+ *		sa - aggregation previously returned by sa_create
+ *
+ * Return:
+ *		NULL                          - on failure
+ *		pointer to struct size_index  - on success
+ */
+struct size_index *sa_freeze(struct size_agg *sa);
+
+
+/*
+ * Release aggregation together with files still in it
+ *
+ * Arguments:
+ *		sa - aggregation previously returned by sa_create
+ */
+void sa_destroy(struct size_agg *sa);
+
+
+#endif
@@ -0,0 +1,343 @@
+/*
+ * Frozen index of potential matches
+ * No references this time
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "thread_pool.h"
+#include "lf_map.h"
+#include "mpmc_lf_queue.h"
+#include "list_utils.h"
+#include "file_desc.h"
+#include "map_iter_task.h"
+#include "obj_cache.h"
+
+#include "size_index.h"
+
+struct si_freeze_ctx {
+	volatile unsigned long group_cnt;
+	struct si_pending *pending;
+	volatile unsigned long slot;
+};
+
+struct si_copy_arg {
+	struct tp_task task;
+	struct size_index *idx;
+	struct si_pending *pending;
+	unsigned long first;
+	unsigned long last;
+};
+
+struct si_foreach_arg {
+	struct tp_task task;
+	struct thread_pool *tp;
+	struct size_index *idx;
+	void (*fn)(struct size_index *idx, struct si_group *g, void *ctx);
+	void *ctx;
+	unsigned long first;
+	unsigned long last;
+};
+
+
+//Group may contain duplicates if it has two files or a file with hard links
+static int si_group_needed(struct mpmcq *q)
+{
+	struct file_desc *fd;
+
+	if(q->elem_cnt != 1)
+		return q->elem_cnt > 1;
+
+	fd = L_DATA(L_NEXT(q->head.ptr.ptr));
+	return fd != NULL && fd->aliases != NULL;
+}
+
+
+//Count groups which may contain duplicates
+static void si_count(struct node *n, void *_ctx)
+{
+	struct si_freeze_ctx *ctx = _ctx;
+	struct mpmcq *q = L_DATA(n);
+
+	if(!si_group_needed(q))
+		return;
+
+	__atomic_add_fetch(&ctx->group_cnt, 1, __ATOMIC_RELAXED);
+}
+
+
+//Save group into pending groups list together with its record sizes
+static void si_collect(struct node *n, void *_ctx)
+{
+	struct si_freeze_ctx *ctx = _ctx;
+	struct mpmcq *q = L_DATA(n);
+	struct mpmcq_elem *e;
+	unsigned long slot, arena_size = 0;
+
+	if(!si_group_needed(q))
+		return;
+
+	L_FOREACH(e, L_NEXT(q->head.ptr.ptr))
+		arena_size += SI_RECORD_SIZE((struct file_desc *)L_DATA(e));
+
+	slot = __atomic_fetch_add(&ctx->slot, 1, __ATOMIC_RELAXED);
+	ctx->pending[slot].size = L_KEY(n);
+	ctx->pending[slot].cnt = q->elem_cnt;
+	ctx->pending[slot].q = q;
+	ctx->pending[slot].list = NULL;
+	ctx->pending[slot].arena_size = arena_size;
+}
+
+
+static int si_pending_cmp(const void *a, const void *b)
+{
+	const struct si_pending *p1 = a, *p2 = b;
+
+	if(p1->size == p2->size)
+		return 0;
+
+	return p1->size < p2->size ? -1 : 1;
+}
+
+
+//Take next file of a pending group
+static struct file_desc *si_pending_next(struct si_pending *p)
+{
+	struct file_desc *fd;
+
+	if(p->q != NULL)
+		return MPMCQ_dequeue(p->q);
+
+	fd = p->list;
+	if(fd != NULL)
+		p->list = fd->next;
+
+	return fd;
+}
+
+
+//Move files of a range of groups into arena
+void si_copy_worker(void *_arg)
+{
+	struct si_copy_arg *arg = _arg;
+	struct size_index *idx = arg->idx;
+	struct si_pending *p;
+	struct si_group *g;
+	struct file_desc *fd;
+	unsigned long i, j, rec_size;
+	char *dst;
+
+	for(i = arg->first; i < arg->last; i++){
+		p = &arg->pending[i];
+		g = &idx->groups[i];
+		dst = idx->arena + p->arena_off;
+
+		for(j = 0; (fd = si_pending_next(p)) != NULL; j++){
+			rec_size = SI_RECORD_SIZE(fd);
+			memcpy(dst, fd, sizeof(*fd) + strlen(fd->filename) + 1);
+			SI_GROUP_FILE(idx, g, j) = (struct file_desc *)dst;
+			dst += rec_size;
+			free(fd);
+		}
+	}
+
+	oc_free(arg);
+	return;
+}
+
+
+struct size_index *si_build(struct thread_pool *tp, struct si_pending *pending,
+							unsigned long group_cnt)
+{
+	struct si_copy_arg *arg;
+	unsigned long i, off, arena_off;
+
+	struct size_index *idx = calloc(1, sizeof(*idx));
+	if(idx == NULL)
+		return NULL;
+
+	//Sort groups by size and lay them out
+	qsort(pending, group_cnt, sizeof(*pending), si_pending_cmp);
+	idx->group_cnt = group_cnt;
+	for(i = 0; i < group_cnt; i++)
+		idx->file_cnt += pending[i].cnt;
+
+	idx->groups = malloc(sizeof(*idx->groups) * (idx->group_cnt + 1));
+	idx->files = calloc(idx->file_cnt + 1, sizeof(*idx->files));
+	if(idx->groups == NULL || idx->files == NULL)
+		goto ERROR;
+
+	for(i = 0, off = 0, arena_off = 0; i < group_cnt; i++){
+		idx->groups[i].size = pending[i].size;
+		idx->groups[i].off = off;
+		idx->groups[i].cnt = pending[i].cnt;
+		pending[i].arena_off = arena_off;
+
+		off += idx->groups[i].cnt;
+		arena_off += pending[i].arena_size;
+	}
+	idx->arena_size = arena_off;
+	idx->arena = malloc(idx->arena_size + 1);
+	if(idx->arena == NULL)
+		goto ERROR;
+
+	//Move file records in parallel
+	for(i = 0; i < group_cnt; i += SI_FREEZE_CHUNK){
+		arg = oc_alloc(sizeof(*arg));
+		if(arg == NULL)
+			goto ERROR_WAIT;
+
+		arg->idx = idx;
+		arg->pending = pending;
+		arg->first = i;
+		arg->last = i + SI_FREEZE_CHUNK;
+		if(arg->last > group_cnt)
+			arg->last = group_cnt;
+		arg->task.task = si_copy_worker;
+		arg->task.arg = arg;
+		arg->task.pool_owned = 0;
+		if(tp_enqueue(tp, &arg->task) != 0){
+			oc_free(arg);
+			goto ERROR_WAIT;
+		}
+	}
+	tp_wait_idle(tp);
+
+	return idx;
+
+ERROR_WAIT:
+	//Let already enqueued copying finish before releasing index
+	tp_wait_idle(tp);
+
+ERROR:
+	si_destroy(idx);
+	return NULL;
+}
+
+
+struct size_index *si_freeze(struct thread_pool *tp, struct map *m)
+{
+	struct si_freeze_ctx ctx;
+	struct size_index *idx;
+
+	//Count candidate groups
+	ctx.group_cnt = 0;
+	ctx.pending = NULL;
+	ctx.slot = 0;
+	if(mit_start(tp, m, si_count, &ctx) != 0){
+		tp_wait_idle(tp);
+		return NULL;
+	}
+	tp_wait_idle(tp);
+
+	//Collect candidate groups
+	ctx.pending = malloc(sizeof(*ctx.pending) * (ctx.group_cnt + 1));
+	if(ctx.pending == NULL)
+		return NULL;
+	if(mit_start(tp, m, si_collect, &ctx) != 0){
+		tp_wait_idle(tp);
+		free(ctx.pending);
+		return NULL;
+	}
+	tp_wait_idle(tp);
+
+	idx = si_build(tp, ctx.pending, ctx.group_cnt);
+	free(ctx.pending);
+
+	return idx;
+}
+
+
+static int si_foreach_enqueue(struct si_foreach_arg *arg,
+								unsigned long first, unsigned long last);
+
+
+void si_foreach_worker(void *_arg)
+{
+	struct si_foreach_arg *arg = _arg;
+	unsigned long i, mid;
+
+	//Give away upper half of the range until it is small enough
+	while(arg->last - arg->first > SI_FOREACH_CHUNK){
+		mid = arg->first + (arg->last - arg->first) / 2;
+		if(si_foreach_enqueue(arg, mid, arg->last) != 0){
+			fprintf(stderr, "Error: Out of memory\n");
+			break;
+		}
+		arg->last = mid;
+	}
+
+	for(i = arg->first; i < arg->last; i++)
+		arg->fn(arg->idx, &arg->idx->groups[i], arg->ctx);
+
+	oc_free(arg);
+	return;
+}
+
+
+static int si_foreach_enqueue(struct si_foreach_arg *arg,
+								unsigned long first, unsigned long last)
+{
+	int status;
+	struct si_foreach_arg *n_arg = oc_alloc(sizeof(*n_arg));
+	if(n_arg == NULL)
+		return -ENOMEM;
+
+	*n_arg = *arg;
+	n_arg->first = first;
+	n_arg->last = last;
+	n_arg->task.task = si_foreach_worker;
+	n_arg->task.arg = n_arg;
+	n_arg->task.pool_owned = 0;
+
+	if((status = tp_enqueue(arg->tp, &n_arg->task)) != 0)
+		oc_free(n_arg);
+
+	return status;
+}
+
+
+int si_foreach(struct thread_pool *tp, struct size_index *idx,
+				void (*fn)(struct size_index *idx, struct si_group *g, void *ctx),
+				void *ctx)
+{
+	struct si_foreach_arg arg;
+
+	if(idx->group_cnt == 0)
+		return 0;
+
+	arg.tp = tp;
+	arg.idx = idx;
+	arg.fn = fn;
+	arg.ctx = ctx;
+
+	return si_foreach_enqueue(&arg, 0, idx->group_cnt);
+}
+
+
+void si_destroy(struct size_index *idx)
+{
+	unsigned long i;
+
+	//Aliases and cached keys are not part of arena
+	for(i = 0; idx->files != NULL && i < idx->file_cnt; i++){
+		if(idx->files[i] != NULL){
+			fd_free_aliases(idx->files[i]);
+			free(idx->files[i]->cache);
+		}
+	}
+
+	free(idx->groups);
+	free(idx->files);
+	free(idx->arena);
+	free(idx);
+
+	return;
+}
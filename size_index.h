@@ -0,0 +1,133 @@
+/*
+ * Frozen index of potential matches
+ * No references this time
+ *
+ * After traversal the size map is not modified anymore, so all groups of
+ * files having the same size are compacted into flat arrays sorted by size.
+ * Files with unique size can never be duplicates and are not included,
+ * unless they have hard links attached as aliases.
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#ifndef __SIZE_INDEX_H
+#define __SIZE_INDEX_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "thread_pool.h"
+#include "lf_map.h"
+#include "mpmc_lf_queue.h"
+#include "file_desc.h"
+
+
+#define SI_FREEZE_CHUNK			256		//Groups copied by a single task
+#define SI_FOREACH_CHUNK		4		//Groups processed by a single task
+
+struct si_group {
+	uint64_t size;
+	uint32_t off;
+	uint32_t cnt;
+};
+
+struct size_index {
+	volatile unsigned long group_cnt;
+	volatile unsigned long file_cnt;
+	volatile unsigned long arena_size;
+
+	//Groups sorted by size, each refers to files[off] .. files[off + cnt - 1]
+	struct si_group *groups;
+	struct file_desc **files;
+
+	//File records packed in the same order as files array
+	char *arena;
+};
+
+//Group of files waiting to be moved into an index. Files are taken either
+//from a map list q or, if q is NULL, from a list linked through next field
+struct si_pending {
+	uint64_t size;
+	uint32_t cnt;
+	struct mpmcq *q;
+	struct file_desc *list;
+	unsigned long arena_off;
+	unsigned long arena_size;
+};
+
+//Iterate through files of a group
+#define SI_GROUP_FILE(idx, g, i)	((idx)->files[(g)->off + (i)])
+
+//Size of a file record in arena, keeping records aligned
+#define SI_RECORD_SIZE(fd)		((sizeof(struct file_desc) + \
+									strlen((fd)->filename) + 1 + 7) & ~7UL)
+
+
+/*
+ * Compact all groups of potential matches into a frozen index
+ *
+ * Files included into index are moved out of the map, thus afterwards
+ * map only holds files of unique sizes and may be freed concurrently with
+ * index processing. Caller must make sure no tasks modify the map and
+ * this function must not be called from a pool thread.
+ *
+ * Arguments:
+ *		tp - thread pool for task execution
+ *		m  - map of files grouped by size
+ *
+ * Return:
+ *		NULL                          - on failure
+ *		pointer to struct size_index  - on success
+ */
+struct size_index *si_freeze(struct thread_pool *tp, struct map *m);
+
+
+/*
+ * Build index out of already collected groups
+ *
+ * Files of all groups are moved into index and released. Groups do not
+ * need to be sorted. Caller must make sure no tasks modify the groups and
+ * this function must not be called from a pool thread.
+ *
+ * Arguments:
+ *		tp        - thread pool for task execution
+ *		pending   - array of groups with cnt and arena_size filled in
+ *		group_cnt - number of groups in pending array
+ *
+ * Return:
+ *		NULL                          - on failure
+ *		pointer to struct size_index  - on success
+ */
+struct size_index *si_build(struct thread_pool *tp, struct si_pending *pending,
+							unsigned long group_cnt);
+
+
+/*
+ * Call a function for every group of the index from all pool threads
+ *
+ * Arguments:
+ *		tp  - thread pool for task execution
+ *		idx - index previously returned by si_freeze
+ *		fn  - function to be called for each group
+ *		ctx - argument passed to fn together with group
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - on failure
+ */
+int si_foreach(struct thread_pool *tp, struct size_index *idx,
+				void (*fn)(struct size_index *idx, struct si_group *g, void *ctx),
+				void *ctx);
+
+
+/*
+ * Release index and all file records in it, including aliases
+ *
+ * Arguments:
+ *		idx - index previously returned by si_freeze
+ */
+void si_destroy(struct size_index *idx);
+
+
+#endif
@@ -0,0 +1,672 @@
+/*
+ * Snapshot of scanned tree for incremental re-scans
+ * No references this time
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "murmur3_hash.h"
+#include "uring_stat.h"
+
+#include "snapshot.h"
+
+#define SS_PAD(len)				(((len) + 7) & ~7UL)
+#define SS_NS(ts)				((ts).tv_sec * 1000000000LL + (ts).tv_nsec)
+
+//Records logged by a single thread
+struct ss_log {
+	char *data;
+	size_t len;
+	size_t cap;
+	struct ss_log *next;
+};
+
+//Set of duplicates, either of previous snapshot or of this run
+struct ss_set {
+	uint64_t key[2];
+	struct ss_record *rec;
+};
+
+struct snapshot {
+	char *path;
+	volatile int failed;
+	volatile uint32_t next_id;
+
+	//Previous snapshot, names point into buffer
+	char *buf;
+	size_t buf_len;
+	struct ss_dir *dirs;
+	unsigned long dir_cnt;
+	struct ss_dir **table;
+	unsigned long mask;
+	struct us_entry *files;
+	char **subdirs;
+	struct ss_set *sets;
+	unsigned long set_cnt;
+
+	//Records of this run
+	struct ss_log *logs;
+	pthread_mutex_t lock;
+};
+
+static struct snapshot *ss;
+static __thread struct ss_log *ss_local;
+
+
+static unsigned long ss_path_hash(const char *path)
+{
+	uint64_t h[2] = {0, 0};
+
+	murmur3(path, strlen(path), h);
+
+	return h[0];
+}
+
+
+//Find slot of a directory path, or a free slot where it belongs
+static struct ss_dir **ss_slot(const char *path)
+{
+	unsigned long i = ss_path_hash(path) & ss->mask;
+
+	while(ss->table[i] != NULL && strcmp(ss->table[i]->path, path) != 0)
+		i = (i + 1) & ss->mask;
+
+	return &ss->table[i];
+}
+
+
+//Get next record of a buffer, checking that it fits in whole
+static struct ss_record *ss_next(char *buf, size_t len, size_t *off)
+{
+	struct ss_record *rec;
+	char *names;
+
+	if(*off + sizeof(*rec) > len)
+		return NULL;
+
+	rec = (struct ss_record *)(buf + *off);
+	if(rec->len == 0 || *off + sizeof(*rec) + SS_PAD(rec->len) > len)
+		return NULL;
+
+	//Names must be terminated
+	names = (char *)(rec + 1);
+	if(names[rec->len - 1] != '\0')
+		return NULL;
+
+	*off += sizeof(*rec) + SS_PAD(rec->len);
+
+	return rec;
+}
+
+
+//Set record must hold exactly as many names as it claims
+static int ss_set_valid(struct ss_record *rec)
+{
+	char *name = (char *)(rec + 1), *end = name + rec->len, *nul;
+	uint32_t cnt = 0;
+
+	while(name < end){
+		nul = memchr(name, '\0', end - name);
+		if(nul == NULL)
+			return 0;
+
+		name = nul + 1;
+		cnt++;
+	}
+
+	return cnt == rec->id;
+}
+
+
+static void ss_set_key(struct ss_set *s)
+{
+	memset(s->key, 0, sizeof(s->key));
+	murmur3(&s->rec->size, sizeof(s->rec->size), s->key);
+	murmur3(s->rec + 1, s->rec->len, s->key);
+
+	return;
+}
+
+
+//Build directories and sets out of records of previous snapshot
+static int ss_parse(void)
+{
+	struct ss_record *rec;
+	struct ss_dir *d;
+	unsigned long file_cnt = 0, dir_cnt = 0, i;
+	size_t off;
+
+	//Count records
+	for(off = sizeof(struct ss_header); (rec = ss_next(ss->buf, ss->buf_len, &off)); ){
+		if(rec->type == SS_DIR && rec->id >= ss->dir_cnt)
+			ss->dir_cnt = rec->id + 1;
+		if(rec->type == SS_SET && ss_set_valid(rec))
+			ss->set_cnt++;
+	}
+
+	ss->dirs = calloc(ss->dir_cnt + 1, sizeof(*ss->dirs));
+	ss->sets = calloc(ss->set_cnt + 1, sizeof(*ss->sets));
+	if(ss->dirs == NULL || ss->sets == NULL)
+		return -ENOMEM;
+
+	ss->set_cnt = 0;
+	for(off = sizeof(struct ss_header); (rec = ss_next(ss->buf, ss->buf_len, &off)); ){
+		if(rec->type == SS_SET){
+			if(!ss_set_valid(rec))
+				continue;
+
+			ss->sets[ss->set_cnt].rec = rec;
+			ss_set_key(&ss->sets[ss->set_cnt++]);
+			continue;
+		}
+
+		if(rec->id >= ss->dir_cnt)
+			continue;
+
+		d = &ss->dirs[rec->id];
+		if(rec->type == SS_DIR){
+			d->path = (char *)(rec + 1);
+			d->mtime = rec->mtime;
+			d->ctime = rec->ctime;
+			d->dev = rec->dev;
+			d->ino = rec->ino;
+		} else if(rec->type == SS_FILE){
+			d->file_cnt++;
+			file_cnt++;
+		} else if(rec->type == SS_SUBDIR){
+			d->dir_cnt++;
+			dir_cnt++;
+		}
+	}
+
+	//Give every directory a slice of entries
+	ss->files = malloc(sizeof(*ss->files) * (file_cnt + 1));
+	ss->subdirs = malloc(sizeof(*ss->subdirs) * (dir_cnt + 1));
+	if(ss->files == NULL || ss->subdirs == NULL)
+		return -ENOMEM;
+
+	for(i = 0, file_cnt = 0, dir_cnt = 0; i < ss->dir_cnt; i++){
+		d = &ss->dirs[i];
+		d->files = ss->files + file_cnt;
+		d->dirs = ss->subdirs + dir_cnt;
+		file_cnt += d->file_cnt;
+		dir_cnt += d->dir_cnt;
+		d->file_cnt = 0;
+		d->dir_cnt = 0;
+	}
+
+	for(off = sizeof(struct ss_header); (rec = ss_next(ss->buf, ss->buf_len, &off)); ){
+		if(rec->id >= ss->dir_cnt)
+			continue;
+
+		d = &ss->dirs[rec->id];
+		if(rec->type == SS_FILE){
+			d->files[d->file_cnt].name = (char *)(rec + 1);
+			d->files[d->file_cnt].size = rec->size;
+			d->files[d->file_cnt].dev = rec->dev;
+			d->files[d->file_cnt].ino = rec->ino;
+			d->files[d->file_cnt].nlink = rec->nlink;
+			d->files[d->file_cnt].mtime = rec->mtime;
+			d->files[d->file_cnt].ctime = rec->ctime;
+			d->files[d->file_cnt].status = 0;
+			d->file_cnt++;
+		} else if(rec->type == SS_SUBDIR){
+			d->dirs[d->dir_cnt++] = (char *)(rec + 1);
+		}
+	}
+
+	//Index directories by path
+	ss->mask = 1023;
+	while(ss->mask + 1 < ss->dir_cnt * 2)
+		ss->mask = ss->mask * 2 + 1;
+
+	ss->table = calloc(ss->mask + 1, sizeof(*ss->table));
+	if(ss->table == NULL)
+		return -ENOMEM;
+
+	for(i = 0; i < ss->dir_cnt; i++)
+		if(ss->dirs[i].path != NULL)
+			*ss_slot(ss->dirs[i].path) = &ss->dirs[i];
+
+	return 0;
+}
+
+
+//Read previous snapshot in whole
+static int ss_load(void)
+{
+	struct ss_header *h;
+	struct stat st;
+	ssize_t ret;
+	size_t off = 0;
+	int f;
+
+	f = open(ss->path, O_RDONLY | O_CLOEXEC);
+	if(f < 0)
+		return errno == ENOENT ? 0 : -errno;
+
+	if(fstat(f, &st) != 0 || st.st_size < sizeof(*h)){
+		close(f);
+		return 0;
+	}
+
+	ss->buf_len = st.st_size;
+	ss->buf = malloc(ss->buf_len);
+	if(ss->buf == NULL){
+		close(f);
+		return -ENOMEM;
+	}
+
+	while(off < ss->buf_len){
+		ret = read(f, ss->buf + off, ss->buf_len - off);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			break;
+		off += ret;
+	}
+	close(f);
+	ss->buf_len = off;
+
+	h = (struct ss_header *)ss->buf;
+	if(ss->buf_len < sizeof(*h) || memcmp(h->magic, SS_MAGIC, sizeof(h->magic)) != 0 ||
+			h->version != SS_VERSION){
+		fprintf(stderr, "Warning: %s: unknown snapshot format, "
+				"doing a full scan\n", ss->path);
+		return 0;
+	}
+
+	return ss_parse();
+}
+
+
+int ss_open(const char *path)
+{
+	int status;
+
+	ss = calloc(1, sizeof(*ss));
+	if(ss == NULL)
+		return -ENOMEM;
+
+	pthread_mutex_init(&ss->lock, NULL);
+	ss->path = strdup(path);
+	if(ss->path == NULL){
+		ss_close();
+		return -ENOMEM;
+	}
+
+	status = ss_load();
+	if(status != 0)
+		ss_close();
+
+	return status;
+}
+
+
+struct ss_dir *ss_find_dir(const char *path, struct stat *st)
+{
+	struct ss_dir *d;
+
+	if(ss == NULL || ss->table == NULL)
+		return NULL;
+
+	//Directory gets new mtime whenever an entry is added, removed or renamed
+	d = *ss_slot(path);
+	if(d == NULL || d->dev != st->st_dev || d->ino != st->st_ino ||
+			d->mtime != SS_NS(st->st_mtim) || d->ctime != SS_NS(st->st_ctim))
+		return NULL;
+
+	return d;
+}
+
+
+//Get log of calling thread, creating it on first use
+static struct ss_log *ss_get_log(void)
+{
+	struct ss_log *l = ss_local;
+	if(l != NULL)
+		return l;
+
+	l = calloc(1, sizeof(*l));
+	if(l == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&ss->lock);
+	l->next = ss->logs;
+	ss->logs = l;
+	pthread_mutex_unlock(&ss->lock);
+
+	ss_local = l;
+
+	return l;
+}
+
+
+//Append a record with len bytes of names to be filled in by caller
+static struct ss_record *ss_append(uint32_t type, uint32_t id, uint32_t len)
+{
+	struct ss_record *rec;
+	struct ss_log *l = ss_get_log();
+	size_t need = sizeof(*rec) + SS_PAD(len), cap;
+	char *data;
+
+	if(l == NULL)
+		goto FAIL;
+
+	if(l->len + need > l->cap){
+		cap = l->cap == 0 ? SS_LOG_SIZE : l->cap;
+		while(l->len + need > cap)
+			cap *= 2;
+
+		data = realloc(l->data, cap);
+		if(data == NULL)
+			goto FAIL;
+		l->data = data;
+		l->cap = cap;
+	}
+
+	rec = (struct ss_record *)(l->data + l->len);
+	memset(rec, 0, need);
+	rec->type = type;
+	rec->id = id;
+	rec->len = len;
+	l->len += need;
+
+	return rec;
+
+FAIL:
+	if(!ss->failed)
+		fprintf(stderr, "Error: snapshot: %s\n", strerror(ENOMEM));
+	ss->failed = 1;
+	return NULL;
+}
+
+
+uint32_t ss_log_dir(const char *path, struct stat *st)
+{
+	struct ss_record *rec;
+	uint32_t id = __atomic_fetch_add(&ss->next_id, 1, __ATOMIC_RELAXED);
+	uint32_t len = strlen(path) + 1;
+
+	rec = ss_append(SS_DIR, id, len);
+	if(rec == NULL)
+		return id;
+
+	rec->dev = st->st_dev;
+	rec->ino = st->st_ino;
+	rec->mtime = SS_NS(st->st_mtim);
+	rec->ctime = SS_NS(st->st_ctim);
+	memcpy(rec + 1, path, len);
+
+	return id;
+}
+
+
+void ss_log_file(uint32_t id, struct us_entry *e)
+{
+	struct ss_record *rec;
+	uint32_t len = strlen(e->name) + 1;
+
+	rec = ss_append(SS_FILE, id, len);
+	if(rec == NULL)
+		return;
+
+	rec->size = e->size;
+	rec->dev = e->dev;
+	rec->ino = e->ino;
+	rec->nlink = e->nlink;
+	rec->mtime = e->mtime;
+	rec->ctime = e->ctime;
+	memcpy(rec + 1, e->name, len);
+
+	return;
+}
+
+
+void ss_log_subdir(uint32_t id, const char *name)
+{
+	struct ss_record *rec;
+	uint32_t len = strlen(name) + 1;
+
+	rec = ss_append(SS_SUBDIR, id, len);
+	if(rec != NULL)
+		memcpy(rec + 1, name, len);
+
+	return;
+}
+
+
+static int ss_name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+
+void ss_log_set(uint64_t size, const char **names, uint32_t cnt)
+{
+	struct ss_record *rec;
+	uint32_t i, len = 0;
+	char *p;
+
+	if(ss == NULL)
+		return;
+
+	//Same set always gets the same record
+	qsort(names, cnt, sizeof(*names), ss_name_cmp);
+	for(i = 0; i < cnt; i++)
+		len += strlen(names[i]) + 1;
+
+	rec = ss_append(SS_SET, cnt, len);
+	if(rec == NULL)
+		return;
+
+	rec->size = size;
+	for(i = 0, p = (char *)(rec + 1); i < cnt; i++)
+		p = stpcpy(p, names[i]) + 1;
+
+	return;
+}
+
+
+static int ss_write(int f, const void *buff, size_t len)
+{
+	ssize_t ret;
+
+	while(len > 0){
+		ret = write(f, buff, len);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0)
+			return -errno;
+
+		buff += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+
+static int ss_key_cmp(const void *_a, const void *_b)
+{
+	const struct ss_set *a = _a, *b = _b;
+
+	if(a->key[0] != b->key[0])
+		return a->key[0] < b->key[0] ? -1 : 1;
+	if(a->key[1] != b->key[1])
+		return a->key[1] < b->key[1] ? -1 : 1;
+
+	return 0;
+}
+
+
+static void ss_print_set(FILE *f, char sign, struct ss_set *s)
+{
+	char *name = (char *)(s->rec + 1), *end = name + s->rec->len;
+	uint32_t i;
+
+	fprintf(f, "%c %u files, %" PRIu64 " bytes each\n", sign, s->rec->id,
+			s->rec->size);
+	for(i = 0; i < s->rec->id && name < end; i++){
+		fprintf(f, "%s\n", name);
+		name += strlen(name) + 1;
+	}
+	fputc('\n', f);
+
+	return;
+}
+
+
+//Print sets which are only in one of the snapshots
+static int ss_diff(const char *diff_path)
+{
+	struct ss_set *cur;
+	struct ss_record *rec;
+	struct ss_log *l;
+	unsigned long cnt = 0, i = 0, j = 0;
+	size_t off;
+	int cmp, status = 0;
+	FILE *f;
+
+	for(l = ss->logs; l != NULL; l = l->next)
+		for(off = 0; (rec = ss_next(l->data, l->len, &off)); )
+			if(rec->type == SS_SET)
+				cnt++;
+
+	cur = malloc(sizeof(*cur) * (cnt + 1));
+	if(cur == NULL)
+		return -ENOMEM;
+
+	cnt = 0;
+	for(l = ss->logs; l != NULL; l = l->next){
+		for(off = 0; (rec = ss_next(l->data, l->len, &off)); ){
+			if(rec->type != SS_SET)
+				continue;
+			cur[cnt].rec = rec;
+			ss_set_key(&cur[cnt++]);
+		}
+	}
+
+	f = fopen(diff_path, "w");
+	if(f == NULL){
+		free(cur);
+		return -errno;
+	}
+
+	//Walk both sorted lists of sets at once
+	qsort(cur, cnt, sizeof(*cur), ss_key_cmp);
+	qsort(ss->sets, ss->set_cnt, sizeof(*ss->sets), ss_key_cmp);
+	while(i < cnt || j < ss->set_cnt){
+		if(i == cnt)
+			cmp = 1;
+		else if(j == ss->set_cnt)
+			cmp = -1;
+		else
+			cmp = ss_key_cmp(&cur[i], &ss->sets[j]);
+
+		if(cmp < 0)
+			ss_print_set(f, '+', &cur[i++]);
+		else if(cmp > 0)
+			ss_print_set(f, '-', &ss->sets[j++]);
+		else
+			i++, j++;
+	}
+
+	if(fclose(f) != 0)
+		status = -errno;
+	free(cur);
+
+	return status;
+}
+
+
+int ss_save(const char *diff_path)
+{
+	struct ss_header h;
+	struct ss_log *l;
+	char *tmp;
+	int f, status;
+
+	if(ss == NULL)
+		return 0;
+
+	//Incomplete snapshot would make missing directories look empty
+	if(ss->failed)
+		return -ENOMEM;
+
+	if(diff_path != NULL && (status = ss_diff(diff_path)) != 0)
+		return status;
+
+	tmp = malloc(strlen(ss->path) + 5);
+	if(tmp == NULL)
+		return -ENOMEM;
+	sprintf(tmp, "%s.tmp", ss->path);
+
+	f = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(f < 0){
+		status = -errno;
+		free(tmp);
+		return status;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SS_MAGIC, sizeof(h.magic));
+	h.version = SS_VERSION;
+	status = ss_write(f, &h, sizeof(h));
+
+	for(l = ss->logs; l != NULL && status == 0; l = l->next)
+		status = ss_write(f, l->data, l->len);
+
+	if(close(f) != 0 && status == 0)
+		status = -errno;
+
+	if(status == 0 && rename(tmp, ss->path) != 0)
+		status = -errno;
+
+	if(status != 0)
+		unlink(tmp);
+	free(tmp);
+
+	return status;
+}
+
+
+void ss_close(void)
+{
+	struct ss_log *l;
+
+	if(ss == NULL)
+		return;
+
+	while(ss->logs != NULL){
+		l = ss->logs;
+		ss->logs = l->next;
+		free(l->data);
+		free(l);
+	}
+
+	free(ss->buf);
+	free(ss->dirs);
+	free(ss->table);
+	free(ss->files);
+	free(ss->subdirs);
+	free(ss->sets);
+	free(ss->path);
+	pthread_mutex_destroy(&ss->lock);
+	free(ss);
+	ss = NULL;
+
+	return;
+}
@@ -0,0 +1,164 @@
+/*
+ * Snapshot of scanned tree for incremental re-scans
+ * No references this time
+ *
+ * Every scanned directory is logged together with its files, their stat
+ * data, and its subdirectories, as well as all sets of duplicates found.
+ * On the next run, a directory whose mtime and ctime did not change has
+ * the same entries, so it is not read again and its files are not stat'ed:
+ * they are replayed from the snapshot instead. Files changed in place keep
+ * their directory unchanged, so they are only noticed once their directory
+ * changes. Contents are always compared anew, so such files may be missed,
+ * but are never reported wrongly.
+ *
+ * Records are logged by every thread into a buffer of its own and are
+ * written out together, so order of records in a file is arbitrary.
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "uring_stat.h"
+
+#define SS_MAGIC				"LSDUPSS1"
+#define SS_VERSION				1
+#define SS_LOG_SIZE				65536	//Initial log size of a thread
+
+//Record types
+#define SS_DIR					1
+#define SS_FILE					2
+#define SS_SUBDIR				3
+#define SS_SET					4
+
+struct ss_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+//Record, followed by len bytes of NUL terminated names, padded to 8 bytes
+struct ss_record {
+	uint32_t type;
+	uint32_t id;				//Directory number, or number of names of a set
+	uint32_t len;
+	uint32_t reserved;
+	uint64_t size;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t nlink;
+	int64_t mtime;
+	int64_t ctime;
+};
+
+//Directory of previous snapshot
+struct ss_dir {
+	char *path;
+	int64_t mtime;
+	int64_t ctime;
+	uint64_t dev;
+	uint64_t ino;
+	uint32_t file_cnt;
+	uint32_t dir_cnt;
+	struct us_entry *files;
+	char **dirs;
+};
+
+
+/*
+ * Load previous snapshot, if there is one
+ *
+ * Arguments:
+ *		path - snapshot file path
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - on failure
+ */
+int ss_open(const char *path);
+
+
+/*
+ * Find directory of previous snapshot, if it did not change since then
+ *
+ * Arguments:
+ *		path - directory path, as it was formatted during traversal
+ *		st   - current stat data of the directory
+ *
+ * Return:
+ *		NULL                       - if directory is not known or changed
+ *		pointer to directory entry - on success
+ */
+struct ss_dir *ss_find_dir(const char *path, struct stat *st);
+
+
+/*
+ * Log a directory being scanned
+ *
+ * Arguments:
+ *		path - directory path
+ *		st   - stat data of the directory
+ *
+ * Return:
+ *		number of directory, to log its entries with
+ */
+uint32_t ss_log_dir(const char *path, struct stat *st);
+
+
+/*
+ * Log a file of a directory
+ *
+ * Arguments:
+ *		id - number of directory
+ *		e  - name and stat data of the file
+ */
+void ss_log_file(uint32_t id, struct us_entry *e);
+
+
+/*
+ * Log a subdirectory of a directory
+ *
+ * Arguments:
+ *		id   - number of directory
+ *		name - name of subdirectory
+ */
+void ss_log_subdir(uint32_t id, const char *name);
+
+
+/*
+ * Log a set of duplicates found. Does nothing, if snapshot is not open
+ *
+ * Arguments:
+ *		size  - size of every file
+ *		names - names of files, sorted in place
+ *		cnt   - number of files
+ */
+void ss_log_set(uint64_t size, const char **names, uint32_t cnt);
+
+
+/*
+ * Write out snapshot of this run, replacing the previous one
+ *
+ * Arguments:
+ *		diff_path - file to write sets of duplicates which appeared ("+")
+ *		            or vanished ("-") since previous snapshot, or NULL
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - on failure
+ */
+int ss_save(const char *diff_path);
+
+
+/*
+ * Release snapshot state
+ */
+void ss_close(void);
+
+
+#endif
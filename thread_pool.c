@@ -7,25 +7,91 @@
  */
 
 #include <stdlib.h>
-#include <time.h>
 #include <stdio.h>
 #include <errno.h>
 
 #include "thread_pool.h"
-#include "mpmc_lf_queue.h"
+#include "mpmc_ring_queue.h"
+#include "ws_deque.h"
+#include "obj_cache.h"
 
-struct task {
-	void (*task)(void *arg);
-	void *arg;
-};
+//Pool worker structure of current thread, NULL for non-pool threads
+static __thread struct tp_worker *tp_self;
+
+
+//Try to steal one task from other threads. Victims are scanned
+//starting from the next thread, so that stealers spread out
+static struct tp_task *tp_steal(struct tp_worker *w)
+{
+	struct thread_pool *tp = w->tp;
+	struct tp_task *t;
+	int i, retry;
+
+	do {
+		retry = 0;
+		for(i = 1; i < tp->num_threads; i++){
+			t = WSDQ_steal(tp->worker[(w->id + i) % tp->num_threads].dq);
+			if(t == WSDQ_ABORT){
+				retry = 1;
+				continue;
+			}
+			if(t != NULL)
+				return t;
+		}
+	} while(retry);
+
+	return NULL;
+}
+
+
+//Get a task for execution: own deque first, then shared queue, then steal
+static struct tp_task *tp_get_task(struct tp_worker *w)
+{
+	struct tp_task *t;
+
+	if((t = WSDQ_pop(w->dq)) != NULL)
+		return t;
+
+	if((t = MPMCRQ_dequeue(w->tp->wq)) != NULL){
+		//Wake up submitters waiting for space in shared queue
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&w->tp->num_blocked_submitters, __ATOMIC_SEQ_CST) != 0){
+			pthread_mutex_lock(&w->tp->mutex);
+			pthread_cond_broadcast(&w->tp->space_cond);
+			pthread_mutex_unlock(&w->tp->mutex);
+		}
+		return t;
+	}
+
+	return tp_steal(w);
+}
+
+
+//Check if there is any task left in any of the queues
+static int tp_has_work(struct thread_pool *tp)
+{
+	int i;
+
+	if(MPMCRQ_count(tp->wq) != 0)
+		return 1;
+
+	for(i = 0; i < tp->num_threads; i++)
+		if(!WSDQ_empty(tp->worker[i].dq))
+			return 1;
+
+	return 0;
+}
 
 
 static void *thread_worker(void *arg)
 {
-	struct thread_pool *tp = arg;
-	struct task *t;
-	struct timespec ts = {0, 1000000}; //1ms
-	int waiting = 0;
+	struct tp_worker *w = arg;
+	struct thread_pool *tp = w->tp;
+	struct tp_task *t;
+	void (*task)(void *);
+	void *task_arg;
+
+	tp_self = w;
 
 	while(1){
 		//check if we need to terminate
@@ -39,30 +105,32 @@ static void *thread_worker(void *arg)
 		pthread_mutex_unlock(&tp->mutex);
 
 		//Try to get one work
-		if((t = MPMCQ_dequeue(tp->wq)) == NULL){
-			//Mark that we are sleeping
-			if(!waiting){
-				__atomic_add_fetch(&tp->num_waiting_threads, 1, __ATOMIC_SEQ_CST);
-				waiting = 1;
-			}
-
-			//sleep for a bit
-			nanosleep(&ts, NULL);
+		if((t = tp_get_task(w)) == NULL){
+			//Mark that we are sleeping and sleep until new work arrives.
+			//Enqueuers check waiting count after enqueue, thus either
+			//we see new element here or they see us waiting
+			pthread_mutex_lock(&tp->mutex);
+			__atomic_add_fetch(&tp->num_waiting_threads, 1, __ATOMIC_SEQ_CST);
+			while(!tp_has_work(tp) && !tp->stop)
+				pthread_cond_wait(&tp->work_cond, &tp->mutex);
+			__atomic_sub_fetch(&tp->num_waiting_threads, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&tp->mutex);
 			continue;
 		}
 
-		//Decrement waiting threads count
-		if(waiting){
-			__atomic_sub_fetch(&tp->num_waiting_threads, 1, __ATOMIC_SEQ_CST);
-			waiting = 0;
+		//Execute task. Descriptor may be released by the task itself
+		task = t->task;
+		task_arg = t->arg;
+		if(t->pool_owned)
+			oc_free(t);
+		task(task_arg);
+
+		//Decrement task count and wake up waiters if that was the last one
+		if(__atomic_sub_fetch(&tp->num_enqueued_tasks, 1, __ATOMIC_SEQ_CST) == 0){
+			pthread_mutex_lock(&tp->mutex);
+			pthread_cond_broadcast(&tp->idle_cond);
+			pthread_mutex_unlock(&tp->mutex);
 		}
-
-		//Execute task
-		t->task(t->arg);
-		free(t);
-
-		//Decrement task count
-		__atomic_sub_fetch(&tp->num_enqueued_tasks, 1, __ATOMIC_SEQ_CST);
 	}
 
 	return NULL;
@@ -74,36 +142,108 @@ struct thread_pool *tp_create(unsigned int num_threads)
 	int i;
 
 	//Allocate thread_pool structure
-	struct thread_pool *tp = calloc(1, sizeof(*tp) + sizeof(pthread_t) * num_threads);
+	struct thread_pool *tp = calloc(1, sizeof(*tp) + sizeof(tp->worker[0]) * num_threads);
 	if(tp == NULL)
 		return NULL;
 
-	//Create workqueue
-	tp->wq = MPMCQ_create();
+	//Create shared workqueue and per thread deques
+	tp->wq = MPMCRQ_create(TP_WQ_SIZE);
+	if(tp->wq == NULL)
+		goto ERROR;
+	for(i = 0; i < num_threads; i++){
+		tp->worker[i].tp = tp;
+		tp->worker[i].id = i;
+		tp->worker[i].dq = WSDQ_create();
+		if(tp->worker[i].dq == NULL)
+			goto ERROR;
+	}
 
 	//setup state variables
 	tp->num_threads = num_threads;
 	tp->num_waiting_threads = 0;
+	tp->num_blocked_submitters = 0;
 	tp->num_enqueued_tasks = 0;
 
 	//Init mutex and thread for thread sleeping
 	pthread_cond_init(&tp->cond, NULL);
+	pthread_cond_init(&tp->work_cond, NULL);
+	pthread_cond_init(&tp->idle_cond, NULL);
+	pthread_cond_init(&tp->space_cond, NULL);
 	pthread_mutex_init(&tp->mutex, NULL);
 	tp->pause = 0;
 	tp->stop = 0;
 
 	//create actual threads
 	for(i = 0; i < num_threads; i++)
-		pthread_create(&tp->thread[i], NULL, thread_worker, tp);
+		pthread_create(&tp->worker[i].thread, NULL, thread_worker, &tp->worker[i]);
 
 	return tp;
+
+ERROR:
+	if(tp->wq != NULL)
+		MPMCRQ_destroy(tp->wq);
+	for(i = 0; i < num_threads; i++)
+		if(tp->worker[i].dq != NULL)
+			WSDQ_destroy(tp->worker[i].dq);
+	free(tp);
+	return NULL;
+}
+
+
+//Enqueue task into shared queue, sleep while it is full
+static int tp_submit(struct thread_pool *tp, struct tp_task *t)
+{
+	int status;
+
+	while((status = MPMCRQ_enqueue(tp->wq, t)) == -EAGAIN){
+		//Workers check blocked submitters count after dequeue, thus either
+		//we see free space here or they see us waiting
+		pthread_mutex_lock(&tp->mutex);
+		__atomic_add_fetch(&tp->num_blocked_submitters, 1, __ATOMIC_SEQ_CST);
+		while(MPMCRQ_count(tp->wq) >= MPMCRQ_size(tp->wq))
+			pthread_cond_wait(&tp->space_cond, &tp->mutex);
+		__atomic_sub_fetch(&tp->num_blocked_submitters, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&tp->mutex);
+	}
+
+	return status;
+}
+
+
+int tp_enqueue(struct thread_pool *tp, struct tp_task *t)
+{
+	int status;
+
+	//increment enqueued task count before task can be seen by workers,
+	//so that count never drops to zero while there is work left
+	__atomic_add_fetch(&tp->num_enqueued_tasks, 1, __ATOMIC_SEQ_CST);
+
+	//Enqueue task to own deque if we are part of the pool
+	if(tp_self != NULL && tp_self->tp == tp)
+		status = WSDQ_push(tp_self->dq, t);
+	else
+		status = tp_submit(tp, t);
+	if(status != 0){
+		__atomic_sub_fetch(&tp->num_enqueued_tasks, 1, __ATOMIC_SEQ_CST);
+		return status;
+	}
+
+	//Wake up one sleeping thread
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&tp->num_waiting_threads, __ATOMIC_SEQ_CST) != 0){
+		pthread_mutex_lock(&tp->mutex);
+		pthread_cond_signal(&tp->work_cond);
+		pthread_mutex_unlock(&tp->mutex);
+	}
+
+	return 0;
 }
 
 
 int tp_enqueueTask(struct thread_pool *tp, void (*task)(void *), void *arg)
 {
 	int status;
-	struct task *t = malloc(sizeof(*t));
+	struct tp_task *t = oc_alloc(sizeof(*t));
 	if(t == NULL){
 		fprintf(stderr, "Out of Memory\n");
 		return -ENOMEM;
@@ -112,18 +252,35 @@ int tp_enqueueTask(struct thread_pool *tp, void (*task)(void *), void *arg)
 	//Setup task variables
 	t->task = task;
 	t->arg = arg;
+	t->pool_owned = 1;
 
 	//Enqueue task
-	status = MPMCQ_enqueue(tp->wq, t);
-
-	//increment enqueued task count
-	if(status == 0)
-		__atomic_add_fetch(&tp->num_enqueued_tasks, 1, __ATOMIC_SEQ_CST);
+	if((status = tp_enqueue(tp, t)) != 0)
+		oc_free(t);
 
 	return status;
 }
 
 
+int tp_worker_id(struct thread_pool *tp)
+{
+	if(tp_self == NULL || tp_self->tp != tp)
+		return -1;
+
+	return tp_self->id;
+}
+
+
+void tp_wait_idle(struct thread_pool *tp)
+{
+	pthread_mutex_lock(&tp->mutex);
+	while(__atomic_load_n(&tp->num_enqueued_tasks, __ATOMIC_SEQ_CST) != 0)
+		pthread_cond_wait(&tp->idle_cond, &tp->mutex);
+	pthread_mutex_unlock(&tp->mutex);
+	return;
+}
+
+
 void tp_pause(struct thread_pool *tp)
 {
 	pthread_mutex_lock(&tp->mutex);
@@ -148,18 +305,27 @@ int tp_destroy(struct thread_pool *tp)
 	int i;
 
 	//check emptyness
-	if(tp->wq->elem_cnt != 0 ||
-			tp->num_enqueued_tasks != 0 ||
-			tp->num_threads != tp->num_waiting_threads)
+	if(tp_has_work(tp) ||
+			tp->num_enqueued_tasks != 0)
 		return -EEXIST;
 
-	//stop thread
+	//stop and wake up threads
+	pthread_mutex_lock(&tp->mutex);
 	tp->stop = 1;
+	pthread_cond_broadcast(&tp->work_cond);
+	pthread_mutex_unlock(&tp->mutex);
 	for(i = 0; i < tp->num_threads; i++)
-		pthread_join(tp->thread[i], NULL);
+		pthread_join(tp->worker[i].thread, NULL);
 
-	//destroy queue
-	MPMCQ_destroy(tp->wq);
+	//destroy queues and synchronization primitives
+	MPMCRQ_destroy(tp->wq);
+	for(i = 0; i < tp->num_threads; i++)
+		WSDQ_destroy(tp->worker[i].dq);
+	pthread_cond_destroy(&tp->cond);
+	pthread_cond_destroy(&tp->work_cond);
+	pthread_cond_destroy(&tp->idle_cond);
+	pthread_cond_destroy(&tp->space_cond);
+	pthread_mutex_destroy(&tp->mutex);
 
 	//release thread pool
 	free(tp);
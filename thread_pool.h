@@ -11,18 +11,42 @@
 #define __THREAD_POOL_H
 
 #include <pthread.h>
-#include "mpmc_lf_queue.h"
+#include "mpmc_ring_queue.h"
+#include "ws_deque.h"
+
+#define TP_WQ_SIZE				1024
+
+struct thread_pool;
+
+//Task descriptor. It can be embedded into task argument structure and
+//enqueued with tp_enqueue, so that no allocation is needed for a task
+struct tp_task {
+	void (*task)(void *arg);
+	void *arg;
+	int pool_owned;
+};
+
+struct tp_worker {
+	struct thread_pool *tp;
+	struct wsdq *dq;
+	unsigned int id;
+	pthread_t thread;
+};
 
 struct thread_pool {
-	struct mpmcq *wq;
+	struct mpmcrq *wq;
 	int num_threads;
 	volatile int num_waiting_threads;
+	volatile int num_blocked_submitters;
 	volatile int num_enqueued_tasks;
 	volatile int stop;
 	volatile int pause;
 	pthread_cond_t cond;
+	pthread_cond_t work_cond;
+	pthread_cond_t idle_cond;
+	pthread_cond_t space_cond;
 	pthread_mutex_t mutex;
-	pthread_t thread[];
+	struct tp_worker worker[];
 };
 
 
@@ -57,6 +81,11 @@ int tp_destroy(struct thread_pool *tp);
 /*
  * Enqueue a task for execution.
  *
+ * Tasks enqueued from within a pool thread go to that thread's own deque and
+ * are executed in LIFO order by it, unless other idle threads steal them.
+ * Tasks enqueued from outside of the pool go to a bounded shared queue.
+ * If shared queue is full, caller sleeps until pool threads make space.
+ *
  * Arguments:
  *		tp   - pointer to struct thread_pool previously returned by tp_create
  *		task - pointer to function of work
@@ -69,6 +98,47 @@ int tp_destroy(struct thread_pool *tp);
 int tp_enqueueTask(struct thread_pool *tp, void (*task)(void *), void *arg);
 
 
+/*
+ * Enqueue a caller provided task descriptor for execution.
+ *
+ * Descriptor is not accessed by the pool after task function is called,
+ * thus task is free to release memory holding the descriptor.
+ *
+ * Arguments:
+ *		tp - pointer to struct thread_pool previously returned by tp_create
+ *		t  - task descriptor with task and arg fields filled in
+ *
+ * Returns:
+ *		0                   - on success
+ *		negative error code - on failure
+ */
+int tp_enqueue(struct thread_pool *tp, struct tp_task *t);
+
+
+/*
+ * Get index of the calling pool thread
+ *
+ * Arguments:
+ *		tp - struct thread pool previously returned by tp_create
+ *
+ * Returns:
+ *		-1                            - if caller is not a thread of this pool
+ *		number in 0..num_threads - 1  - on success
+ */
+int tp_worker_id(struct thread_pool *tp);
+
+
+/*
+ * Wait until all enqueued tasks, including tasks enqueued by other tasks,
+ * have finished executing. Calling thread sleeps while waiting.
+ *
+ * Arguments:
+ *		tp - struct thread pool previously returned by tp_create
+ *
+ */
+void tp_wait_idle(struct thread_pool *tp);
+
+
 /*
  * Pause threads execution.
  *
@@ -0,0 +1,268 @@
+/*
+ * Batched asynchronous stat of directory entries using io_uring
+ * Reference: https://kernel.dk/io_uring.pdf
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <linux/stat.h>
+#include <linux/io_uring.h>
+
+#include "uring_stat.h"
+
+#define LOAD_ACQ(ptr)			__atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define STORE_REL(ptr, val)		__atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+#define US_NOT_CREATED			0
+#define US_READY				1
+#define US_UNUSABLE				-1
+
+#define US_PROBE_OPS			256		//Opcodes asked about when probing
+
+struct us_ring {
+	int state;
+	int fd;
+
+	//Submission queue
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+
+	//Completion queue
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	//Mappings to be released
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_len;
+	size_t cq_len;
+	size_t sqes_len;
+
+	//Results of requests in flight
+	struct statx *stx;
+};
+
+static __thread struct us_ring us_ring;
+
+static pthread_key_t us_key;
+static pthread_once_t us_key_once = PTHREAD_ONCE_INIT;
+
+
+//Release ring of exiting thread
+static void us_ring_release(void *arg)
+{
+	struct us_ring *r = arg;
+
+	if(r->fd >= 0)
+		close(r->fd);
+	if(r->sqes != NULL)
+		munmap(r->sqes, r->sqes_len);
+	if(r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_len);
+	if(r->sq_ptr != NULL)
+		munmap(r->sq_ptr, r->sq_len);
+	free(r->stx);
+
+	memset(r, 0, sizeof(*r));
+	r->state = US_UNUSABLE;
+	r->fd = -1;
+
+	return;
+}
+
+
+static void us_key_create(void)
+{
+	pthread_key_create(&us_key, us_ring_release);
+}
+
+
+//Check if ring supports STATX requests. Rings of kernels older than 5.6
+//support neither STATX nor probing
+static int us_probe_statx(int fd)
+{
+	struct io_uring_probe *p;
+	int supported;
+
+	p = calloc(1, sizeof(*p) + US_PROBE_OPS * sizeof(p->ops[0]));
+	if(p == NULL)
+		return 0;
+
+	supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+						p, US_PROBE_OPS) == 0 &&
+				p->last_op >= IORING_OP_STATX &&
+				(p->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+	free(p);
+
+	return supported;
+}
+
+
+static int us_ring_create(struct us_ring *r)
+{
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+
+	r->fd = syscall(__NR_io_uring_setup, US_RING_ENTRIES, &p);
+	if(r->fd < 0)
+		return -errno;
+
+	pthread_once(&us_key_once, us_key_create);
+	pthread_setspecific(us_key, r);
+
+	if(!us_probe_statx(r->fd))
+		return -EOPNOTSUPP;
+
+	//Map rings, single mapping holds both of them on newer kernels
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		if(r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sq_ptr == MAP_FAILED){
+		r->sq_ptr = NULL;
+		return -ENOMEM;
+	}
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if(r->cq_ptr == MAP_FAILED){
+			r->cq_ptr = NULL;
+			return -ENOMEM;
+		}
+	}
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+					MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED){
+		r->sqes = NULL;
+		return -ENOMEM;
+	}
+
+	r->sq_tail = r->sq_ptr + p.sq_off.tail;
+	r->sq_mask = r->sq_ptr + p.sq_off.ring_mask;
+	r->sq_array = r->sq_ptr + p.sq_off.array;
+	r->cq_head = r->cq_ptr + p.cq_off.head;
+	r->cq_tail = r->cq_ptr + p.cq_off.tail;
+	r->cq_mask = r->cq_ptr + p.cq_off.ring_mask;
+	r->cqes = r->cq_ptr + p.cq_off.cqes;
+
+	r->stx = calloc(US_RING_ENTRIES, sizeof(*r->stx));
+	if(r->stx == NULL)
+		return -ENOMEM;
+
+	r->state = US_READY;
+
+	return 0;
+}
+
+
+//Get ring of calling thread, creating it on first use
+static struct us_ring *us_get_ring(void)
+{
+	struct us_ring *r = &us_ring;
+
+	if(r->state == US_NOT_CREATED && us_ring_create(r) != 0){
+		us_ring_release(r);
+		r->state = US_UNUSABLE;
+	}
+
+	return r->state == US_READY ? r : NULL;
+}
+
+
+int us_stat_batch(int dfd, struct us_entry *e, int cnt)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	unsigned tail, head, idx;
+	int i, ret, done = 0, to_submit = cnt, calls = 0;
+
+	struct us_ring *r = us_get_ring();
+	if(r == NULL)
+		return -ENOSYS;
+
+	if(cnt > US_RING_ENTRIES)
+		return -EINVAL;
+
+	//Fill in submission entries. This thread is the only producer
+	tail = *r->sq_tail;
+	for(i = 0; i < cnt; i++){
+		idx = (tail + i) & *r->sq_mask;
+		sqe = &r->sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = dfd;
+		sqe->addr = (uintptr_t)e[i].name;
+		sqe->len = STATX_SIZE | STATX_INO | STATX_NLINK | STATX_MTIME | STATX_CTIME;
+		sqe->off = (uintptr_t)&r->stx[i];
+		sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+		sqe->user_data = i;
+		r->sq_array[idx] = idx;
+	}
+	STORE_REL(r->sq_tail, tail + cnt);
+
+	//Submit and wait for all completions
+	while(done < cnt){
+		calls++;
+		ret = syscall(__NR_io_uring_enter, r->fd, to_submit, cnt - done,
+						IORING_ENTER_GETEVENTS, NULL, 0);
+		if(ret < 0){
+			if(errno == EINTR)
+				continue;
+
+			//Requests may still be in flight, so ring can't be reused
+			r->state = US_UNUSABLE;
+			return -errno;
+		}
+		to_submit -= ret;
+
+		//Reap completions
+		head = *r->cq_head;
+		while(head != LOAD_ACQ(r->cq_tail)){
+			cqe = &r->cqes[head & *r->cq_mask];
+			i = cqe->user_data;
+			e[i].status = cqe->res < 0 ? cqe->res : 0;
+			e[i].size = r->stx[i].stx_size;
+			e[i].dev = makedev(r->stx[i].stx_dev_major, r->stx[i].stx_dev_minor);
+			e[i].ino = r->stx[i].stx_ino;
+			e[i].nlink = r->stx[i].stx_nlink;
+			e[i].mtime = r->stx[i].stx_mtime.tv_sec * 1000000000LL +
+							r->stx[i].stx_mtime.tv_nsec;
+			e[i].ctime = r->stx[i].stx_ctime.tv_sec * 1000000000LL +
+							r->stx[i].stx_ctime.tv_nsec;
+
+			head++;
+			done++;
+		}
+		STORE_REL(r->cq_head, head);
+	}
+
+	return calls;
+}
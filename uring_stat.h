@@ -0,0 +1,53 @@
+/*
+ * Batched asynchronous stat of directory entries using io_uring
+ * Reference: https://kernel.dk/io_uring.pdf
+ *
+ * Every thread owns a ring, created on first use. Whole batch of STATX
+ * requests is submitted with a single system call and completions are
+ * reaped as they arrive, so that many metadata requests are in flight
+ * at once. If io_uring or its STATX request is not available, callers fall
+ * back to fstatat.
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#ifndef __URING_STAT_H
+#define __URING_STAT_H
+
+#include <stdint.h>
+
+#define US_RING_ENTRIES			64		//Max requests in a single batch
+
+
+struct us_entry {
+	char *name;
+	uint64_t size;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t nlink;
+	int64_t mtime;		//Nanoseconds
+	int64_t ctime;
+	int status;
+};
+
+
+/*
+ * Stat a batch of entries of a directory
+ *
+ * Arguments:
+ *		dfd - descriptor of directory names are relative to
+ *		e   - entries to stat, size, dev, ino, nlink, mtime, ctime and status
+ *		      are filled in for each of them: status is 0 on success or
+ *		      negative error code
+ *		cnt - number of entries, at most US_RING_ENTRIES
+ *
+ * Return:
+ *		number of system calls made - on success
+ *		negative error code         - if io_uring is not usable by this thread,
+ *		                              or it can't stat files
+ */
+int us_stat_batch(int dfd, struct us_entry *e, int cnt);
+
+
+#endif
@@ -0,0 +1,1175 @@
+/*
+ * Live index of duplicates, kept up to date with inotify events
+ * Reference: https://man7.org/linux/man-pages/man7/inotify.7.html
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+
+#include "thread_pool.h"
+#include "lf_map.h"
+#include "mpmc_lf_queue.h"
+#include "list_utils.h"
+#include "file_desc.h"
+#include "murmur3_hash.h"
+#include "obj_cache.h"
+#include "calc_hash_task.h"
+#include "dir_trav_task.h"
+#include "output.h"
+#include "ebr.h"
+
+#include "watch.h"
+
+#define WT_CMP_CHUNK			1048576 //1MB
+
+#define WT_MASK					(IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | \
+									IN_MOVED_FROM | IN_MOVED_TO | \
+									IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+//Top bit of a key is reserved by the map
+#define WT_KEY(h)				((h) & ~(1ULL << 63))
+
+#define WT_SAME_KEY(a, b)		((a)->fd->hash_stage == (b)->fd->hash_stage && \
+									(a)->fd->hash[0] == (b)->fd->hash[0] && \
+									(a)->fd->hash[1] == (b)->fd->hash[1])
+
+struct wt_group;
+
+struct wt_file {
+	struct wt_file *next;		//Next file of the same size
+	struct wt_file *hnext;		//Next file of the same path key
+	struct wt_file *inext;		//Next file of the same inode key
+	struct wt_file *cls;		//First file of equal content, NULL if not known yet
+	struct wt_group *g;
+	struct file_desc *fd;
+};
+
+//Files of the same size. Classified by a pool task once changed
+struct wt_group {
+	struct tp_task task;
+	uint64_t size;
+	uint32_t cnt;
+	int dirty;
+	struct wt_group *dnext;		//Next changed group
+	struct wt_file *head;
+};
+
+struct wt_dir {
+	int wd;
+	char path[];
+};
+
+struct watch {
+	int ifd;
+	struct map *dirs;			//Watched directories by watch descriptor
+	struct map *paths;			//Files by key of their path
+	struct map *inodes;			//Files by key of their inode, to find hard links
+	struct map *sizes;			//Groups by size
+	struct wt_group *dirty;
+
+	//Directories to be traversed once events are applied
+	char **rescan;
+	unsigned long rescan_cnt;
+	unsigned long rescan_cap;
+	int overflow;
+
+	struct wt_stats stats;
+};
+
+static struct watch wt = {.ifd = -1};
+
+//Signals are turned into a readable pipe, to be polled together with the rest
+static int wt_pipe[2] = {-1, -1};
+
+
+static uint64_t wt_path_key(const char *path)
+{
+	uint64_t h[2] = {0, 0};
+
+	murmur3(path, strlen(path), h);
+
+	return WT_KEY(h[0]);
+}
+
+
+static uint64_t wt_inode_key(uint64_t dev, uint64_t ino)
+{
+	uint64_t id[2] = {dev, ino}, h[2] = {0, 0};
+
+	murmur3(id, sizeof(id), h);
+
+	return WT_KEY(h[0]);
+}
+
+
+//Format path of an entry of a directory, the same way traversal does
+static char *wt_path(const char *dir, const char *name)
+{
+	int len = strlen(dir), sep = len == 0 || dir[len - 1] != '/';
+	char *path = malloc(len + sep + strlen(name) + 1);
+	if(path == NULL)
+		return NULL;
+
+	memcpy(path, dir, len);
+	if(sep)
+		path[len] = '/';
+	strcpy(path + len + sep, name);
+
+	return path;
+}
+
+
+//Check if path is a directory or lies under it
+static int wt_under(const char *path, const char *dir, size_t len)
+{
+	if(strncmp(path, dir, len) != 0)
+		return 0;
+
+	return path[len] == '\0' || path[len] == '/' || (len > 0 && dir[len - 1] == '/');
+}
+
+
+static struct wt_file *wt_find(const char *path)
+{
+	struct wt_file *f = map_find(wt.paths, wt_path_key(path));
+
+	while(f != NULL && strcmp(f->fd->filename, path) != 0)
+		f = f->hnext;
+
+	return f;
+}
+
+
+static void wt_mark(struct wt_group *g)
+{
+	if(g->dirty)
+		return;
+
+	g->dirty = 1;
+	g->dnext = wt.dirty;
+	wt.dirty = g;
+
+	return;
+}
+
+
+static struct wt_group *wt_get_group(uint64_t size)
+{
+	struct wt_group *g = map_find(wt.sizes, size);
+	if(g != NULL)
+		return g;
+
+	g = calloc(1, sizeof(*g));
+	if(g == NULL)
+		return NULL;
+
+	g->size = size;
+	if(map_add(wt.sizes, size, g) != 0){
+		free(g);
+		return NULL;
+	}
+
+	return g;
+}
+
+
+//Unlink file from its path chain
+static void wt_unlink_path(struct wt_file *f)
+{
+	uint64_t key = wt_path_key(f->fd->filename);
+	struct wt_file *head = map_find(wt.paths, key), **pp;
+
+	if(head == f){
+		if(f->hnext != NULL)
+			map_update(wt.paths, key, f->hnext);
+		else
+			map_rm(wt.paths, key);
+		return;
+	}
+
+	for(pp = &head; *pp != NULL; pp = &(*pp)->hnext){
+		if(*pp == f){
+			*pp = f->hnext;
+			break;
+		}
+	}
+
+	return;
+}
+
+
+//Unlink file from its inode chain
+static void wt_unlink_inode(struct wt_file *f)
+{
+	uint64_t key = wt_inode_key(f->fd->dev, f->fd->ino);
+	struct wt_file *head = map_find(wt.inodes, key), **pp;
+
+	if(head == f){
+		if(f->inext != NULL)
+			map_update(wt.inodes, key, f->inext);
+		else
+			map_rm(wt.inodes, key);
+		return;
+	}
+
+	for(pp = &head; *pp != NULL; pp = &(*pp)->inext){
+		if(*pp == f){
+			*pp = f->inext;
+			break;
+		}
+	}
+
+	return;
+}
+
+
+static void wt_remove(struct wt_file *f)
+{
+	struct wt_group *g = f->g;
+	struct wt_file **pp, *n, *lead = NULL;
+
+	wt_unlink_path(f);
+	wt_unlink_inode(f);
+
+	for(pp = &g->head; *pp != NULL; pp = &(*pp)->next){
+		if(*pp == f){
+			*pp = f->next;
+			break;
+		}
+	}
+	g->cnt--;
+
+	//Equality is transitive, so any other member may lead the class
+	if(f->cls == f){
+		for(n = g->head; n != NULL; n = n->next){
+			if(n->cls != f)
+				continue;
+			if(lead == NULL)
+				lead = n;
+			n->cls = lead;
+		}
+	}
+
+	//Empty group is released once changed groups are classified
+	wt_mark(g);
+	wt.stats.files--;
+
+	fd_free(f->fd);
+	free(f);
+
+	return;
+}
+
+
+//Add file into index, replacing file of the same path
+static int wt_add(struct file_desc *fd)
+{
+	struct wt_file *f, *head;
+	struct wt_group *g;
+	uint64_t key;
+
+	if((f = wt_find(fd->filename)) != NULL)
+		wt_remove(f);
+
+	f = calloc(1, sizeof(*f));
+	g = wt_get_group(fd->size);
+	if(f == NULL || g == NULL){
+		fprintf(stderr, "Error: %s: %s\n", fd->filename, strerror(ENOMEM));
+		fd_free(fd);
+		free(f);
+		return -ENOMEM;
+	}
+	f->fd = fd;
+	f->g = g;
+
+	//Path keys of different files may collide, such files are chained
+	key = wt_path_key(fd->filename);
+	if((head = map_find(wt.paths, key)) != NULL){
+		f->hnext = head->hnext;
+		head->hnext = f;
+	} else if(map_add(wt.paths, key, f) != 0){
+		fprintf(stderr, "Error: %s: %s\n", fd->filename, strerror(ENOMEM));
+		fd_free(fd);
+		free(f);
+		return -ENOMEM;
+	}
+
+	//Without inode chain, other hard links are not updated with this file
+	key = wt_inode_key(fd->dev, fd->ino);
+	if((head = map_find(wt.inodes, key)) != NULL){
+		f->inext = head->inext;
+		head->inext = f;
+	} else if(map_add(wt.inodes, key, f) != 0){
+		fprintf(stderr, "Error: %s: %s\n", fd->filename, strerror(ENOMEM));
+	}
+
+	f->next = g->head;
+	g->head = f;
+	g->cnt++;
+	wt_mark(g);
+	wt.stats.files++;
+
+	return 0;
+}
+
+
+//Hard links are added as files on their own, every path is watched separately
+static void wt_add_linked(struct file_desc *fd)
+{
+	struct file_desc *a = fd->aliases, *next;
+
+	fd->aliases = NULL;
+	fd->next = NULL;
+	wt_add(fd);
+
+	for(; a != NULL; a = next){
+		next = a->next;
+		a->next = NULL;
+		wt_add(a);
+	}
+
+	return;
+}
+
+
+//Compare two files of a group, reading both of them in whole
+static int wt_same(struct wt_file *a, struct wt_file *b)
+{
+	uint64_t off, size = a->g->size, len;
+	uint8_t *buff1, *buff2;
+	struct stat st1, st2;
+	int f1, f2, same = 0;
+	ssize_t ret1, ret2;
+
+	if(a->fd->dev == b->fd->dev && a->fd->ino == b->fd->ino)
+		return 1;
+
+	buff1 = oc_scratch(OC_SCRATCH_CMP1, WT_CMP_CHUNK);
+	buff2 = oc_scratch(OC_SCRATCH_CMP2, WT_CMP_CHUNK);
+	if(buff1 == NULL || buff2 == NULL)
+		return 0;
+
+	f1 = open(a->fd->filename, O_RDONLY | O_CLOEXEC);
+	f2 = open(b->fd->filename, O_RDONLY | O_CLOEXEC);
+	if(f1 < 0 || f2 < 0)
+		goto CLEANUP;
+
+	//Files may have changed since their events were applied
+	if(fstat(f1, &st1) != 0 || fstat(f2, &st2) != 0 ||
+			st1.st_size != size || st2.st_size != size)
+		goto CLEANUP;
+
+	for(off = 0; off < size; off += len){
+		len = size - off < WT_CMP_CHUNK ? size - off : WT_CMP_CHUNK;
+
+		do {
+			ret1 = pread(f1, buff1, len, off);
+		} while(ret1 < 0 && errno == EINTR);
+		do {
+			ret2 = pread(f2, buff2, len, off);
+		} while(ret2 < 0 && errno == EINTR);
+
+		if(ret1 != len || ret2 != len || memcmp(buff1, buff2, len) != 0)
+			goto CLEANUP;
+	}
+	same = 1;
+
+CLEANUP:
+	if(f1 >= 0)
+		close(f1);
+	if(f2 >= 0)
+		close(f2);
+	return same;
+}
+
+
+//Put every new file of a changed group into a class of equal files
+static void wt_group_worker(void *_arg)
+{
+	struct wt_group *g = _arg;
+	struct wt_file *f, *l;
+
+	for(f = g->head; f != NULL; f = f->next){
+		if(f->cls != NULL)
+			continue;
+
+		//Unreadable file is left in a class of its own
+		if(g->size != 0 && cht_hash_full(f->fd) != 0){
+			f->cls = f;
+			continue;
+		}
+
+		for(l = g->head; l != NULL; l = l->next)
+			if(l != f && l->cls == l && WT_SAME_KEY(l, f) && wt_same(l, f))
+				break;
+
+		f->cls = l != NULL ? l : f;
+		__atomic_add_fetch(&wt.stats.hashed, 1, __ATOMIC_RELAXED);
+	}
+
+	return;
+}
+
+
+//Classify changed groups of at least two files, release empty ones
+static void wt_classify(struct thread_pool *tp)
+{
+	struct wt_group *g, *next;
+
+	for(g = wt.dirty; g != NULL; g = g->dnext){
+		if(g->cnt < 2)
+			continue;
+
+		g->task.task = wt_group_worker;
+		g->task.arg = g;
+		g->task.pool_owned = 0;
+		if(tp_enqueue(tp, &g->task) != 0)
+			wt_group_worker(g);
+	}
+	tp_wait_idle(tp);
+
+	for(g = wt.dirty; g != NULL; g = next){
+		next = g->dnext;
+		g->dirty = 0;
+		if(g->cnt == 0){
+			map_rm(wt.sizes, g->size);
+			free(g);
+		}
+	}
+	wt.dirty = NULL;
+
+	return;
+}
+
+
+//Move all files of a traversal map into index
+static int wt_merge_map(struct map *m)
+{
+	struct map_range r;
+	struct file_desc *fd;
+	struct node *n;
+
+	if(map_get_range(m, 0, 0, &r) != 0){
+		map_discard(m);
+		return -ENOMEM;
+	}
+
+	ebr_enter();
+	L_FOREACH_RANGE(n, &r){
+		if(L_KEY(n) == LF_MAP_DUMMY_N_KEY || L_DATA(n) == NULL)
+			continue;
+
+		while((fd = MPMCQ_dequeue(L_DATA(n))) != NULL)
+			wt_add_linked(fd);
+		MPMCQ_destroy(L_DATA(n));
+	}
+	ebr_exit();
+
+	map_discard(m);
+
+	return 0;
+}
+
+
+int wt_merge(struct thread_pool *tp, struct map *m)
+{
+	int status = wt_merge_map(m);
+
+	wt_classify(tp);
+
+	return status;
+}
+
+
+//Collect data of every element of a map into an array
+static void **wt_collect(struct map *m, unsigned long *cnt)
+{
+	struct map_range r;
+	struct node *n;
+	void **data = NULL, **tmp;
+	unsigned long cap = 0;
+
+	*cnt = 0;
+	if(map_get_range(m, 0, 0, &r) != 0)
+		return NULL;
+
+	ebr_enter();
+	L_FOREACH_RANGE(n, &r){
+		if(L_KEY(n) == LF_MAP_DUMMY_N_KEY || L_DATA(n) == NULL)
+			continue;
+
+		if(*cnt == cap){
+			cap = cap == 0 ? 1024 : cap * 2;
+			tmp = realloc(data, sizeof(*data) * cap);
+			if(tmp == NULL){
+				fprintf(stderr, "Error: Out of memory\n");
+				break;
+			}
+			data = tmp;
+		}
+		data[(*cnt)++] = L_DATA(n);
+	}
+	ebr_exit();
+
+	return data;
+}
+
+
+//Forget everything under a directory which is gone or moved away
+static void wt_drop(const char *dir)
+{
+	struct wt_file *f, *next, **files;
+	struct wt_dir **dirs, *d;
+	unsigned long cnt, i;
+	size_t len = strlen(dir);
+
+	//Files of a chain are removed from its end, so that the head goes last
+	files = (struct wt_file **)wt_collect(wt.paths, &cnt);
+	for(i = 0; i < cnt; i++){
+		for(f = files[i]; f != NULL; f = next){
+			next = f->hnext;
+			if(wt_under(f->fd->filename, dir, len) && f != files[i])
+				wt_remove(f);
+		}
+		if(wt_under(files[i]->fd->filename, dir, len))
+			wt_remove(files[i]);
+	}
+	free(files);
+
+	//Watches of removed directories are dropped with IN_IGNORED
+	dirs = (struct wt_dir **)wt_collect(wt.dirs, &cnt);
+	for(i = 0; i < cnt; i++){
+		if(!wt_under(dirs[i]->path, dir, len))
+			continue;
+
+		inotify_rm_watch(wt.ifd, dirs[i]->wd);
+		if(map_take(wt.dirs, dirs[i]->wd, (void **)&d) == 0)
+			free(d);
+	}
+	free(dirs);
+
+	return;
+}
+
+
+//Put a file into index anew, with its stat data
+static int wt_add_stat(const char *path, struct stat *st)
+{
+	struct file_desc *fd;
+
+	fd = calloc(1, sizeof(*fd) + strlen(path) + 1);
+	if(fd == NULL){
+		fprintf(stderr, "Error: %s: %s\n", path, strerror(ENOMEM));
+		return -ENOMEM;
+	}
+
+	strcpy(fd->filename, path);
+	fd->size = st->st_size;
+	fd->dev = st->st_dev;
+	fd->ino = st->st_ino;
+	fd->mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+	fd->ctime = st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec;
+
+	return wt_add(fd);
+}
+
+
+//Event of a write is reported for a single name only, so other hard links
+//of the inode are put into index anew together with it
+static void wt_update_links(const char *path, struct stat *st)
+{
+	struct wt_file *f, **links = NULL, **tmp;
+	int64_t mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+	unsigned long cnt = 0, i;
+
+	f = map_find(wt.inodes, wt_inode_key(st->st_dev, st->st_ino));
+	for(; f != NULL; f = f->inext){
+		if(f->fd->dev != st->st_dev || f->fd->ino != st->st_ino ||
+				strcmp(f->fd->filename, path) == 0)
+			continue;
+		if(f->fd->size == st->st_size && f->fd->mtime == mtime)
+			continue;
+
+		tmp = realloc(links, sizeof(*links) * (cnt + 1));
+		if(tmp == NULL){
+			fprintf(stderr, "Error: Out of memory\n");
+			break;
+		}
+		links = tmp;
+		links[cnt++] = f;
+	}
+
+	//Every link is replaced by a file of its own path only
+	for(i = 0; i < cnt; i++)
+		wt_add_stat(links[i]->fd->filename, st);
+	free(links);
+
+	return;
+}
+
+
+//Stat a file of an event and put it into index anew
+static void wt_update(char *path, uint32_t mask)
+{
+	struct wt_file *f;
+	struct stat st;
+
+	//File may be gone again, or may not be a regular file anymore
+	if(lstat(path, &st) != 0 || !S_ISREG(st.st_mode)){
+		if((f = wt_find(path)) != NULL)
+			wt_remove(f);
+		return;
+	}
+
+	//New file is still being written, unless it is a new hard link
+	if((mask & IN_CREATE) && st.st_nlink < 2)
+		return;
+
+	if(wt_add_stat(path, &st) == 0 && st.st_nlink > 1)
+		wt_update_links(path, &st);
+
+	return;
+}
+
+
+static void wt_queue_rescan(char *path)
+{
+	char **tmp;
+
+	if(wt.rescan_cnt == wt.rescan_cap){
+		wt.rescan_cap = wt.rescan_cap == 0 ? 64 : wt.rescan_cap * 2;
+		tmp = realloc(wt.rescan, sizeof(*tmp) * wt.rescan_cap);
+		if(tmp == NULL){
+			fprintf(stderr, "Error: %s: %s\n", path, strerror(ENOMEM));
+			free(path);
+			return;
+		}
+		wt.rescan = tmp;
+	}
+
+	wt.rescan[wt.rescan_cnt++] = path;
+
+	return;
+}
+
+
+static void wt_event(struct inotify_event *ev, int dtt_flags)
+{
+	struct wt_dir *d;
+	struct wt_file *f;
+	char *path;
+
+	wt.stats.events++;
+
+	if(ev->mask & IN_Q_OVERFLOW){
+		wt.overflow = 1;
+		return;
+	}
+
+	if(ev->mask & IN_IGNORED){
+		if(map_take(wt.dirs, ev->wd, (void **)&d) == 0)
+			free(d);
+		return;
+	}
+
+	//Events of watched directory itself are followed by events of its parent
+	d = map_find(wt.dirs, ev->wd);
+	if(ev->len == 0 || d == NULL)
+		return;
+
+	path = wt_path(d->path, ev->name);
+	if(path == NULL){
+		fprintf(stderr, "Error: %s\n", strerror(ENOMEM));
+		wt.overflow = 1;
+		return;
+	}
+
+	if(ev->mask & IN_ISDIR){
+		//Removed directory is empty, moved one takes its files along
+		if(ev->mask & IN_MOVED_FROM)
+			wt_drop(path);
+
+		if((ev->mask & (IN_CREATE | IN_MOVED_TO)) && (dtt_flags & DTT_RECURSIVE)){
+			wt_queue_rescan(path);
+			return;
+		}
+	} else if(ev->mask & (IN_DELETE | IN_MOVED_FROM)){
+		if((f = wt_find(path)) != NULL)
+			wt_remove(f);
+	} else {
+		wt_update(path, ev->mask);
+	}
+
+	free(path);
+
+	return;
+}
+
+
+//Traverse new directories and move their files into index
+static void wt_rescan(struct thread_pool *tp, int dtt_flags)
+{
+	struct map *m;
+	unsigned long i;
+
+	if(wt.rescan_cnt == 0)
+		return;
+
+	m = map_create();
+	if(m == NULL){
+		fprintf(stderr, "Error: %s\n", strerror(ENOMEM));
+		goto CLEANUP;
+	}
+
+	for(i = 0; i < wt.rescan_cnt; i++)
+		if(dtt_start(wt.rescan[i], tp, m, NULL, dtt_flags) != 0)
+			fprintf(stderr, "Error: %s: could not traverse\n", wt.rescan[i]);
+
+	tp_wait_idle(tp);
+	dtt_finish();
+
+	if(wt_merge_map(m) != 0)
+		fprintf(stderr, "Error: %s\n", strerror(ENOMEM));
+
+CLEANUP:
+	for(i = 0; i < wt.rescan_cnt; i++)
+		free(wt.rescan[i]);
+	wt.rescan_cnt = 0;
+
+	return;
+}
+
+
+static double wt_elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+//Apply all queued events, then classify changed groups
+static void wt_apply(struct thread_pool *tp, char *root, int dtt_flags, int flags)
+{
+	char buf[WT_EVENT_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	struct timespec start;
+	unsigned long events = wt.stats.events, hashed = wt.stats.hashed;
+	ssize_t n, off;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while((n = read(wt.ifd, buf, sizeof(buf))) > 0){
+		for(off = 0; off < n; off += sizeof(*ev) + ev->len){
+			ev = (struct inotify_event *)(buf + off);
+			wt_event(ev, dtt_flags);
+		}
+	}
+	if(n < 0 && errno != EAGAIN && errno != EINTR)
+		fprintf(stderr, "Error: inotify: %s\n", strerror(errno));
+
+	//Events were lost, so nothing is known for sure anymore
+	if(wt.overflow){
+		fprintf(stderr, "Warning: inotify queue overflow, scanning %s again\n", root);
+		wt.overflow = 0;
+		wt_drop(root);
+		while(wt.rescan_cnt > 0)
+			free(wt.rescan[--wt.rescan_cnt]);
+		wt_queue_rescan(strdup(root));
+	}
+
+	wt_rescan(tp, dtt_flags);
+	wt_classify(tp);
+
+	if(flags & WT_STATS)
+		fprintf(stderr, "%-10s %lu events %lu files classified %lu files "
+				"%.1f us\n", "update", wt.stats.events - events,
+				__atomic_load_n(&wt.stats.hashed, __ATOMIC_RELAXED) - hashed,
+				wt.stats.files, wt_elapsed(&start) * 1e6);
+
+	return;
+}
+
+
+static int wt_member_cmp(const void *_a, const void *_b)
+{
+	const struct wt_file *a = *(const struct wt_file **)_a;
+	const struct wt_file *b = *(const struct wt_file **)_b;
+
+	if(a->cls != b->cls)
+		return a->cls < b->cls ? -1 : 1;
+	if(a->fd->dev != b->fd->dev)
+		return a->fd->dev < b->fd->dev ? -1 : 1;
+	if(a->fd->ino != b->fd->ino)
+		return a->fd->ino < b->fd->ino ? -1 : 1;
+
+	return 0;
+}
+
+
+//Print classes of at least two files of a group, or only class cls
+static void wt_print_group(struct wt_group *g, struct wt_file *cls)
+{
+	struct wt_file **m, *f;
+	const char **names;
+	uint32_t cnt = 0, first, last, i, j, inodes;
+
+	m = malloc(sizeof(*m) * g->cnt);
+	names = malloc(sizeof(*names) * g->cnt);
+	if(m == NULL || names == NULL){
+		fprintf(stderr, "Error: Out of memory\n");
+		goto CLEANUP;
+	}
+
+	for(f = g->head; f != NULL; f = f->next)
+		if(f->cls != NULL && (cls == NULL || f->cls == cls))
+			m[cnt++] = f;
+
+	qsort(m, cnt, sizeof(*m), wt_member_cmp);
+
+	for(first = 0; first < cnt; first = last){
+		//Hard links of the same inode don't waste space
+		inodes = 1;
+		for(last = first + 1; last < cnt && m[last]->cls == m[first]->cls; last++)
+			if(wt_member_cmp(&m[last], &m[last - 1]) != 0)
+				inodes++;
+
+		if(last - first < 2)
+			continue;
+
+		if(out_format() == OUT_PAIRS){
+			for(i = first; i < last; i++)
+				for(j = first; j < i; j++)
+					out_pair(m[j]->fd->filename, m[i]->fd->filename);
+			continue;
+		}
+
+		for(i = first; i < last; i++)
+			names[i - first] = m[i]->fd->filename;
+		out_set(g->size, g->size * (inodes - 1), names, last - first);
+	}
+
+CLEANUP:
+	free(m);
+	free(names);
+	return;
+}
+
+
+static void wt_print_sets(void)
+{
+	struct wt_group **groups;
+	unsigned long cnt, i;
+
+	groups = (struct wt_group **)wt_collect(wt.sizes, &cnt);
+	for(i = 0; i < cnt; i++)
+		if(groups[i]->cnt > 1)
+			wt_print_group(groups[i], NULL);
+	free(groups);
+
+	return;
+}
+
+
+static void wt_print_dups(const char *path)
+{
+	struct wt_file *f = wt_find(path);
+
+	if(f != NULL && f->cls != NULL)
+		wt_print_group(f->g, f->cls);
+
+	return;
+}
+
+
+//Answer a single query of a client
+static void wt_query(int s, int flags)
+{
+	static const char err[] = "Error: unknown query\n";
+	struct timeval tv = {.tv_sec = WT_IO_TIMEOUT};
+	struct timespec start;
+	char q[WT_QUERY_SIZE], *nl = NULL;
+	size_t len = 0;
+	ssize_t ret;
+	int c;
+
+	c = accept(s, NULL, NULL);
+	if(c < 0)
+		return;
+	fcntl(c, F_SETFD, FD_CLOEXEC);
+
+	//Stalled client must not hold up the index
+	setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	while(nl == NULL && len < sizeof(q) - 1){
+		ret = read(c, q + len, sizeof(q) - 1 - len);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			break;
+
+		q[len + ret] = '\0';
+		nl = strchr(q + len, '\n');
+		len += ret;
+	}
+	q[len] = '\0';
+	if(nl != NULL)
+		*nl = '\0';
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	out_set_fd(c);
+
+	if(strcmp(q, "sets") == 0)
+		wt_print_sets();
+	else if(strncmp(q, "dups ", 5) == 0)
+		wt_print_dups(q + 5);
+	else if(write(c, err, sizeof(err) - 1) < 0)
+		fprintf(stderr, "Error: query: %s\n", strerror(errno));
+
+	out_set_fd(STDOUT_FILENO);
+	close(c);
+
+	if(flags & WT_STATS)
+		fprintf(stderr, "%-10s %.1f us\n", "query", wt_elapsed(&start) * 1e6);
+
+	return;
+}
+
+
+static void wt_signal(int sig)
+{
+	int saved = errno;
+	ssize_t ret;
+
+	//Pipe is only polled for, so it being full is not an error
+	ret = write(wt_pipe[1], "", 1);
+	(void)ret;
+	errno = saved;
+
+	return;
+}
+
+
+static int wt_listen(const char *path)
+{
+	struct sockaddr_un a;
+	struct stat st;
+	mode_t mask;
+	int s, status;
+
+	memset(&a, 0, sizeof(a));
+	a.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(a.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(a.sun_path, path);
+
+	s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(s < 0)
+		return -errno;
+
+	//Socket left behind by a previous instance
+	if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	//Answers list names of directories other users may not be able to read,
+	//so socket is created accessible to the owner only. Pool is idle here
+	mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+	status = bind(s, (struct sockaddr *)&a, sizeof(a));
+	umask(mask);
+
+	if(status != 0 || listen(s, WT_BACKLOG) != 0){
+		status = -errno;
+		close(s);
+		return status;
+	}
+
+	return s;
+}
+
+
+int wt_open(void)
+{
+	wt.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(wt.ifd < 0)
+		return -errno;
+
+	wt.dirs = map_create();
+	wt.paths = map_create();
+	wt.inodes = map_create();
+	wt.sizes = map_create();
+	if(wt.dirs == NULL || wt.paths == NULL || wt.inodes == NULL || wt.sizes == NULL){
+		wt_close();
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+
+void wt_watch_dir(const char *path)
+{
+	struct wt_dir *d, *old;
+	int wd;
+
+	wd = inotify_add_watch(wt.ifd, path, WT_MASK);
+	if(wd < 0){
+		fprintf(stderr, "Error: watch %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	d = malloc(sizeof(*d) + strlen(path) + 1);
+	if(d == NULL){
+		fprintf(stderr, "Error: watch %s: %s\n", path, strerror(ENOMEM));
+		return;
+	}
+	d->wd = wd;
+	strcpy(d->path, path);
+
+	//Directory watched already is known under the latest path
+	if(map_add(wt.dirs, wd, d) != 0){
+		old = map_update(wt.dirs, wd, d);
+		free(old != NULL ? old : d);
+	}
+
+	return;
+}
+
+
+int wt_serve(struct thread_pool *tp, char *root, int dtt_flags,
+				const char *sock_path, int flags)
+{
+	struct sigaction sa;
+	struct pollfd p[3];
+	int s, status = 0;
+
+	if(pipe(wt_pipe) != 0)
+		return -errno;
+	fcntl(wt_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(wt_pipe[1], F_SETFD, FD_CLOEXEC);
+	fcntl(wt_pipe[1], F_SETFL, O_NONBLOCK);
+
+	s = wt_listen(sock_path);
+	if(s < 0){
+		close(wt_pipe[0]);
+		close(wt_pipe[1]);
+		return s;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wt_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	//Client gone early must not kill us
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	p[0].fd = wt.ifd;
+	p[1].fd = s;
+	p[2].fd = wt_pipe[0];
+	p[0].events = p[1].events = p[2].events = POLLIN;
+
+	while(1){
+		if(poll(p, 3, -1) < 0){
+			if(errno == EINTR)
+				continue;
+			status = -errno;
+			break;
+		}
+
+		if(p[2].revents)
+			break;
+
+		//Apply changes first, so that answers reflect them
+		if(p[0].revents)
+			wt_apply(tp, root, dtt_flags, flags);
+
+		if(p[1].revents)
+			wt_query(s, flags);
+	}
+
+	close(s);
+	unlink(sock_path);
+	close(wt_pipe[0]);
+	close(wt_pipe[1]);
+
+	return status;
+}
+
+
+void wt_get_stats(struct wt_stats *s)
+{
+	s->files = wt.stats.files;
+	s->hashed = __atomic_load_n(&wt.stats.hashed, __ATOMIC_RELAXED);
+	s->events = wt.stats.events;
+
+	return;
+}
+
+
+void wt_close(void)
+{
+	struct wt_file **files, *f, *next;
+	void **data;
+	unsigned long cnt, i;
+
+	if(wt.paths != NULL){
+		files = (struct wt_file **)wt_collect(wt.paths, &cnt);
+		for(i = 0; i < cnt; i++){
+			for(f = files[i]; f != NULL; f = next){
+				next = f->hnext;
+				fd_free(f->fd);
+				free(f);
+			}
+		}
+		free(files);
+		map_discard(wt.paths);
+	}
+
+	//Files are released with their paths
+	if(wt.inodes != NULL)
+		map_discard(wt.inodes);
+
+	if(wt.sizes != NULL){
+		data = wt_collect(wt.sizes, &cnt);
+		for(i = 0; i < cnt; i++)
+			free(data[i]);
+		free(data);
+		map_discard(wt.sizes);
+	}
+
+	if(wt.dirs != NULL){
+		data = wt_collect(wt.dirs, &cnt);
+		for(i = 0; i < cnt; i++)
+			free(data[i]);
+		free(data);
+		map_discard(wt.dirs);
+	}
+
+	if(wt.ifd >= 0)
+		close(wt.ifd);
+
+	free(wt.rescan);
+	memset(&wt, 0, sizeof(wt));
+	wt.ifd = -1;
+
+	return;
+}
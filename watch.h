@@ -0,0 +1,125 @@
+/*
+ * Live index of duplicates, kept up to date with inotify events
+ * Reference: https://man7.org/linux/man-pages/man7/inotify.7.html
+ *
+ * Files found by the initial scan are moved out of the traversal map into
+ * an index of groups of files of the same size. Every scanned directory is
+ * watched, and its events are applied to the index as they arrive: only
+ * files created, written or moved in are stat'ed and hashed again, while
+ * new directories are traversed on their own. Files of a group are split
+ * into classes of equal content by full content key and byte comparison,
+ * so queries are answered from memory. A file is hashed only once its
+ * group holds another file.
+ *
+ * Index is changed only by the thread serving queries. Changed groups are
+ * classified by the thread pool in between.
+ *
+ * Queries are read from a UNIX stream socket, one line per connection:
+ *		"sets"        - all sets of equal files
+ *		"dups <path>" - set of files equal to <path>
+ * Answer is written in the selected output format, then the connection is
+ * closed. Socket is created with mode 0600, so that only its owner can ask
+ * about names of directories others might not be allowed to read.
+ *
+ * Files changed without being closed after writing (through mmap or
+ * truncate()) are noticed only once they are closed. If event queue
+ * overflows, index is built anew.
+ *
+ * Author: Rytis Karpuška
+ *         rytis.karpuska@gmail.com
+ */
+
+#ifndef __WATCH_H
+#define __WATCH_H
+
+#include "thread_pool.h"
+#include "lf_map.h"
+
+
+#define WT_EVENT_BUF_SIZE		65536	//Events read at once
+#define WT_QUERY_SIZE			8192	//Max length of a query line
+#define WT_IO_TIMEOUT			1		//Seconds a client may stall
+#define WT_BACKLOG				16
+
+//Serving flags
+#define WT_STATS				(1 << 0)	//Print time of every update and query
+
+//Index counters
+struct wt_stats {
+	unsigned long files;		//Files in index
+	unsigned long hashed;		//Files classified so far
+	unsigned long events;
+};
+
+
+/*
+ * Create inotify instance and empty index. Must be called before traversal
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - on failure
+ */
+int wt_open(void);
+
+
+/*
+ * Start watching a directory. Called by traversal for every directory
+ * it reads, may be called from many threads at once
+ *
+ * Arguments:
+ *		path - directory path, as it was formatted during traversal
+ */
+void wt_watch_dir(const char *path);
+
+
+/*
+ * Move files out of traversal map into index and classify them
+ *
+ * Waits for the pool to become idle, so must not be called from a pool
+ * thread. Map is destroyed.
+ *
+ * Arguments:
+ *		tp - thread pool for task execution
+ *		m  - map of traversal, filled in with DTT_WATCH set
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - on failure
+ */
+int wt_merge(struct thread_pool *tp, struct map *m);
+
+
+/*
+ * Apply events to index and answer queries, until SIGINT or SIGTERM
+ *
+ * Arguments:
+ *		tp        - thread pool for task execution
+ *		root      - path initial scan was started at
+ *		dtt_flags - traversal flags for new directories, DTT_WATCH included
+ *		sock_path - path of UNIX socket to listen at
+ *		flags     - WT_STATS bit, or 0
+ *
+ * Return:
+ *		0                   - on success
+ *		negative error code - on failure
+ */
+int wt_serve(struct thread_pool *tp, char *root, int dtt_flags,
+				const char *sock_path, int flags);
+
+
+/*
+ * Get index counters
+ *
+ * Arguments:
+ *		s - structure to fill with counters
+ */
+void wt_get_stats(struct wt_stats *s);
+
+
+/*
+ * Release index and stop watching
+ */
+void wt_close(void);
+
+
+#endif
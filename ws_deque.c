@@ -0,0 +1,182 @@
+/*
+ * Implementation of work stealing deque
+ * Reference: http://www.di.ens.fr/~zappa/readings/ppopp13.pdf
+ *
+ * Owner thread pushes and pops elements at the bottom of the deque (LIFO),
+ * any other thread may steal elements from the top of the deque (FIFO)
+ *
+ * Author: Rytis Karpuška
+ *			rytis.karpuska@gmail.com
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "ws_deque.h"
+
+#define LOAD(ptr, order)		__atomic_load_n(ptr, order)
+#define STORE(ptr, val, order)	__atomic_store_n(ptr, val, order)
+#define FENCE(order)			__atomic_thread_fence(order)
+#define CAS(ptr, expected, desired) __atomic_compare_exchange_n(ptr, \
+														expected, \
+														desired, \
+														0, \
+														__ATOMIC_SEQ_CST, \
+														__ATOMIC_RELAXED)
+
+#define ELEM(a, i)				(&(a)->buf[(i) & ((a)->size - 1)])
+
+
+static struct wsdq_array *wsdq_array_create(long size)
+{
+	struct wsdq_array *a = malloc(sizeof(*a) + sizeof(void *) * size);
+	if(a == NULL)
+		return NULL;
+
+	a->size = size;
+	a->prev = NULL;
+
+	return a;
+}
+
+
+//Double the array size. Old arrays are kept until destroy,
+//because stealers may still be reading from them
+static struct wsdq_array *wsdq_grow(struct wsdq *q, struct wsdq_array *a,
+									long top, long bottom)
+{
+	long i;
+	struct wsdq_array *n = wsdq_array_create(a->size * 2);
+	if(n == NULL)
+		return NULL;
+
+	for(i = top; i < bottom; i++)
+		STORE(ELEM(n, i), LOAD(ELEM(a, i), __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+
+	n->prev = a;
+	STORE(&q->array, n, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+
+struct wsdq *WSDQ_create(void)
+{
+	struct wsdq *q = malloc(sizeof(*q));
+	if(q == NULL)
+		return NULL;
+
+	q->array = wsdq_array_create(WSDQ_INIT_SIZE);
+	if(q->array == NULL){
+		free(q);
+		return NULL;
+	}
+
+	q->top = 0;
+	q->bottom = 0;
+
+	return q;
+}
+
+
+void WSDQ_destroy(struct wsdq *q)
+{
+	struct wsdq_array *tmp, *a = q->array;
+
+	//Free current and all retired arrays
+	while(a != NULL){
+		tmp = a;
+		a = a->prev;
+		free(tmp);
+	}
+
+	free(q);
+
+	return;
+}
+
+
+int WSDQ_push(struct wsdq *q, void *elem)
+{
+	//Check if element is valid
+	if(elem == NULL)
+		return -EINVAL;
+
+	long b = LOAD(&q->bottom, __ATOMIC_RELAXED);
+	long t = LOAD(&q->top, __ATOMIC_ACQUIRE);
+	struct wsdq_array *a = LOAD(&q->array, __ATOMIC_RELAXED);
+
+	//Grow if full
+	if(b - t > a->size - 1){
+		a = wsdq_grow(q, a, t, b);
+		if(a == NULL)
+			return -ENOMEM;
+	}
+
+	//Publish element
+	STORE(ELEM(a, b), elem, __ATOMIC_RELAXED);
+	FENCE(__ATOMIC_RELEASE);
+	STORE(&q->bottom, b + 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+
+void *WSDQ_pop(struct wsdq *q)
+{
+	void *elem;
+	long b = LOAD(&q->bottom, __ATOMIC_RELAXED) - 1;
+	struct wsdq_array *a = LOAD(&q->array, __ATOMIC_RELAXED);
+	long t;
+
+	//Reserve bottom element before looking at top
+	STORE(&q->bottom, b, __ATOMIC_RELAXED);
+	FENCE(__ATOMIC_SEQ_CST);
+	t = LOAD(&q->top, __ATOMIC_RELAXED);
+
+	//Empty deque - restore bottom
+	if(t > b){
+		STORE(&q->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	elem = LOAD(ELEM(a, b), __ATOMIC_RELAXED);
+
+	//Last element - race against stealers for it
+	if(t == b){
+		if(!CAS(&q->top, &t, t + 1))
+			elem = NULL;
+		STORE(&q->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+
+	return elem;
+}
+
+
+void *WSDQ_steal(struct wsdq *q)
+{
+	void *elem;
+	struct wsdq_array *a;
+	long t = LOAD(&q->top, __ATOMIC_ACQUIRE);
+	FENCE(__ATOMIC_SEQ_CST);
+	long b = LOAD(&q->bottom, __ATOMIC_ACQUIRE);
+
+	if(t >= b)
+		return NULL;
+
+	//Read element before trying to take it
+	a = LOAD(&q->array, __ATOMIC_ACQUIRE);
+	elem = LOAD(ELEM(a, t), __ATOMIC_RELAXED);
+	if(!CAS(&q->top, &t, t + 1))
+		return WSDQ_ABORT;
+
+	return elem;
+}
+
+
+int WSDQ_empty(struct wsdq *q)
+{
+	return LOAD(&q->bottom, __ATOMIC_SEQ_CST) - LOAD(&q->top, __ATOMIC_SEQ_CST) <= 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Implementation of work stealing deque
+ * Reference: http://www.di.ens.fr/~zappa/readings/ppopp13.pdf
+ *
+ * Owner thread pushes and pops elements at the bottom of the deque (LIFO),
+ * any other thread may steal elements from the top of the deque (FIFO)
+ *
+ * Author: Rytis Karpuška
+ *			rytis.karpuska@gmail.com
+ *
+ */
+
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <stdint.h>
+
+#define WSDQ_INIT_SIZE			256
+
+//Returned by WSDQ_steal when element was taken by another thread
+#define WSDQ_ABORT				((void *)-1)
+
+struct wsdq_array {
+	long size;
+	struct wsdq_array *prev;
+	void *buf[];
+};
+
+struct wsdq {
+	volatile long top;
+	char pad[64 - sizeof(long)];
+	volatile long bottom;
+	struct wsdq_array *array;
+};
+
+
+/*
+ * Create a new work stealing deque
+ *
+ * Return:
+ * 		NULL                   - if error occured
+ * 		pointer to struct wsdq - on success
+ */
+struct wsdq *WSDQ_create(void);
+
+
+/*
+ * Destroy a deque previously created with WSDQ_create
+ * NOTE: This function does not free data stored in deque
+ * NOTE: This function does not support concurrency
+ *
+ * Arguments:
+ * 		q - pointer to deque previously created with WSDQ_create
+ */
+void WSDQ_destroy(struct wsdq *q);
+
+
+/*
+ * Push an element to the bottom of the deque
+ * NOTE: Only owner of the deque may call this function
+ *
+ * Arguments:
+ * 		q    - deque previously created by WSDQ_create
+ * 		elem - pointer to data
+ *
+ * Return:
+ * 		0                   - on success
+ * 		negative error code - on failure
+ */
+int WSDQ_push(struct wsdq *q, void *elem);
+
+
+/*
+ * Pop an element from the bottom of the deque
+ * NOTE: Only owner of the deque may call this function
+ *
+ * Arguments:
+ * 		q - deque previously created by WSDQ_create
+ *
+ * Return:
+ * 		NULL            - if deque is empty
+ * 		pointer to data - on success
+ */
+void *WSDQ_pop(struct wsdq *q);
+
+
+/*
+ * Steal an element from the top of the deque
+ *
+ * Arguments:
+ * 		q - deque previously created by WSDQ_create
+ *
+ * Return:
+ * 		NULL            - if deque is empty
+ * 		WSDQ_ABORT      - if other thread took the element first
+ * 		pointer to data - on success
+ */
+void *WSDQ_steal(struct wsdq *q);
+
+
+/*
+ * Check if deque looks empty. Result is only a hint under concurrency
+ *
+ * Arguments:
+ * 		q - deque previously created by WSDQ_create
+ *
+ * Return:
+ * 		0       - if deque has elements
+ * 		1       - if deque is empty
+ */
+int WSDQ_empty(struct wsdq *q);
+
+
+#endif